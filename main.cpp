@@ -6,17 +6,94 @@
 #include "database_features.h"
 #include "database_shoes.h"
 #include "evaluate.h"
+#include "feature_index.h"
 #include "service.h"
 #include "utils.h"
 
 using namespace cv;
 
+crow::json::wvalue hogProjectionRecallToJson(const HOGProjectionRecall& report) {
+    crow::json::wvalue response;
+    response["projection"] = report.projection;
+    response["dimension"] = report.dimension;
+    response["retainedVariance"] = report.retainedVariance;
+    response["rawBytesPerShoe"] = report.rawBytesPerShoe;
+    response["projectedBytesPerShoe"] = report.projectedBytesPerShoe;
+    response["queries"] = report.nrOfQueries;
+    response["rawScoringMicroseconds"] = report.rawScoringMicroseconds;
+    response["projectedScoringMicroseconds"] = report.projectedScoringMicroseconds;
+    response["recallAtK"] = report.recallAtK;
+    response["hogRecallAtK"] = report.hogRecallAtK;
+    return response;
+}
+
 int main()
 {
     crow::SimpleApp app; //define your crow application
     //set logging
     crow::logger::setLogLevel(crow::LogLevel::INFO);
 
+    // Load the stored shoe features once, requests query the resident index afterwards
+    // The HNSW graph lets /evaluate?mode=hnsw search the HOG features in sub-linear time, it is built
+    // only when SHOES_HOG_GRAPH is set, without it mode=hnsw falls back to an exact search
+    HNSWParameters hogGraphParameters;
+    if (getConfiguredHNSWParameters(hogGraphParameters)) {
+        getShoeFeatureIndex().enableHOGGraph(hogGraphParameters);
+        CROW_LOG_INFO << "HNSW graph over the HOG features enabled";
+    }
+    // Features of other descriptor profiles are stored next to the default ones, tagged with their profile
+    try {
+        ensureDescriptorProfileColumns();
+    } catch (const std::exception &e) {
+        CROW_LOG_ERROR << "Failed to add the descriptor profile columns: " << e.what();
+    }
+    // Every save also stores the features of a shoe as one serialized feature record
+    try {
+        ensureFeatureRecordTable();
+    } catch (const std::exception &e) {
+        CROW_LOG_ERROR << "Failed to create the feature record table: " << e.what();
+    }
+    // With a fitted PCA projection the index scores reduced HOG features, it is fitted offline with /train-hog-projection
+    try {
+        auto hogProjection = std::make_shared<HOGProjection>();
+        hogProjection->load(defaultHOGProjectionPath);
+        CROW_LOG_INFO << "Loaded HOG projection " << hogProjection->name();
+        getShoeFeatureIndex().setHOGProjection(std::move(hogProjection));
+    } catch (const std::exception &e) {
+        CROW_LOG_INFO << "No HOG projection loaded: " << e.what();
+    }
+    // The compressed IVF-PQ index is trained offline with /train-ivfpq-index and reused across restarts
+    try {
+        auto ivfpq = std::make_unique<IVFPQIndex>();
+        ivfpq->load(defaultIVFPQIndexPath);
+        CROW_LOG_INFO << "Loaded " << ivfpq->size() << " shoes into the IVF-PQ index";
+        getShoeFeatureIndex().setIVFPQIndex(std::move(ivfpq));
+    } catch (const std::exception &e) {
+        CROW_LOG_INFO << "No IVF-PQ index loaded: " << e.what();
+    }
+    // With SHOES_IVFPQ_CODES_ONLY only the IVF-PQ codes stay resident, the full matrix is loaded when there is no index
+    getShoeFeatureIndex().setCodesOnly(isIVFPQCodesOnlyConfigured());
+    try {
+        getShoeFeatureIndex().load();
+        CROW_LOG_INFO << "Loaded " << getShoeFeatureIndex().size() << " shoes into the feature index";
+    } catch (const std::exception &e) {
+        CROW_LOG_ERROR << "Failed to load the feature index, reload it with /reload-feature-index: " << e.what();
+    }
+    // Dominant color search runs against a resident copy of the evaluate_shoedominantcolor table
+    try {
+        getDominantColorIndex().load(getShoeImagesWithDominantColors());
+        CROW_LOG_INFO << "Loaded " << getDominantColorIndex().size() << " shoes into the dominant color index";
+    } catch (const std::exception &e) {
+        CROW_LOG_ERROR << "Failed to load the dominant color index: " << e.what();
+    }
+    // Mean color search runs against a resident grid over the evaluate_shoeproperties table
+    try {
+        getShoeColorGrid().load(getShoeColors());
+        CROW_LOG_INFO << "Loaded " << getShoeColorGrid().size() << " shoes into the mean color grid";
+    } catch (const std::exception &e) {
+        CROW_LOG_ERROR << "Failed to load the mean color grid: " << e.what();
+    }
+
     //define your endpoint at the root directory
     CROW_ROUTE(app, "/")([](){
         CROW_LOG_INFO << "running / route";
@@ -74,16 +151,35 @@ int main()
                 return crow::response(imageAndIdResponse.statusCode, imageAndIdResponse.errorMessage);
             }
 
-            // Compute shoe properties and save them to database
+            // Optional compact descriptor profile, the resident index only holds the default profile
+            DescriptorProfile profile;
             try {
-                cv::Mat resizedImage = preprocessImages(image);
-                // showMat(resizedImage);
-
-                std::vector<cv::Mat> RGBHistograms = computeRGBHistograms(resizedImage);
-                cv::Mat lbpHistogram = computeLBPHistogram(resizedImage);
-                cv::Mat hogDescriptor = computeHOGFeatures(resizedImage);
+                const char* profileName = req.url_params.get("profile");
+                profile = getDescriptorProfile(profileName ? profileName : defaultDescriptorProfileName);
+            } catch (const std::exception &e) {
+                return crow::response(400, e.what());
+            }
 
-                saveShoeProperties(id, RGBHistograms, lbpHistogram, hogDescriptor);
+            // Compute shoe properties and save them to database
+            try {
+                // Segment the shoe once, the mask and crop are shared by every extractor
+                SegmentedShoe segmentedShoe = segmentShoe(image);
+                // showMat(segmentedShoe.image);
+
+                FeatureExtractionPipeline pipeline(segmentedShoe);
+                std::vector<cv::Mat> RGBHistograms = pipeline.computeRGBHistograms(profile.rgbBins);
+                cv::Mat lbpHistogram = pipeline.computeLBPHistogram(profile.lbpMapping);
+                cv::Mat hogDescriptor = pipeline.computeHOGFeatures();
+
+                // The features and the mean color of the shoe, summed over the segmented foreground,
+                // are stored in a single transaction
+                ShoeFeatureRecord record{id, ShoeProperties{RGBHistograms, lbpHistogram, hogDescriptor}, pipeline.computeShoeColorRGB()};
+                saveShoeFeatureRecords({record}, profile.name);
+
+                // Keep the resident index in sync so the shoe can be found without a reload
+                if (profile.name == defaultDescriptorProfileName) {
+                    getShoeFeatureIndex().add(id, record.shoeProperties);
+                }
             } catch (const std::exception &e) {
                 return crow::response(500, e.what());
             }
@@ -107,10 +203,17 @@ int main()
                 return crow::response(imagesResponse.statusCode, imagesResponse.errorMessage);
             }
 
-            // stretch them to a fixed size 656x656
-            for (int i = 0; i < images.size(); i++) {
-                images[i] = preprocessImages(images[i]);
-                std::cout << "image" << i << "size after preprocessing" << images[i].size() << std::endl;
+            // crop them to the shoe and stretch them to the feature size, all images in parallel
+            std::vector<SegmentedShoe> segmentedShoes;
+            std::vector<ShoeProperties> shoeFeatures;
+            try {
+                segmentedShoes = segmentShoes(images);
+                shoeFeatures = computeShoeFeatures(segmentedShoes);
+            } catch (const std::exception &e) {
+                return crow::response(500, e.what());
+            }
+            for (int i = 0; i < segmentedShoes.size(); i++) {
+                std::cout << "image" << i << "size after preprocessing" << segmentedShoes[i].image.size() << std::endl;
             }
 
 
@@ -121,18 +224,10 @@ int main()
             std::vector<std::vector<cv::Mat>> histograms;
             std::vector<cv::Mat> lbpHistograms;
             std::vector<cv::Mat> hogDescriptors;
-            for (int i = 0; i < images.size(); i++) {
-                auto histogramsForImage = computeRGBHistograms(images[i]);
-                histograms.push_back(histogramsForImage);
-                std::cout << "Computed histograms for image " << i << std::endl;
-
-                auto lbpHistogramsForImage = computeLBPHistogram(images[i]);
-                lbpHistograms.push_back(lbpHistogramsForImage);
-                std::cout << "Computed LBP histograms for image " << i << std::endl;
-
-                auto hogDescriptorForImage = computeHOGFeatures(images[i]);
-                hogDescriptors.push_back(hogDescriptorForImage);
-                std::cout << "Computed HOG descriptor for image " << i << std::endl;
+            for (const ShoeProperties& shoeFeaturesForImage : shoeFeatures) {
+                histograms.push_back(shoeFeaturesForImage.rgbHistograms);
+                lbpHistograms.push_back(shoeFeaturesForImage.lbpHistogram);
+                hogDescriptors.push_back(shoeFeaturesForImage.hogFeatures);
             }
 
             // Compare first image and find most similar image from other images
@@ -268,28 +363,26 @@ int main()
                 std::cout << "image" << i << "size after preprocessing" << images[i].size() << std::endl;
             }
 
-            // Compute shoe properties
+            // Compute shoe properties of all images in parallel
+            std::vector<FeatureExtractionPipeline> pipelines(images.begin(), images.end());
+            std::vector<ShoeProperties> shoeFeatures;
+            try {
+                shoeFeatures = computeShoeFeatures(pipelines);
+            } catch (const std::exception &e) {
+                return crow::response(500, e.what());
+            }
+
             std::vector<std::vector<cv::Mat>> histograms;
             std::vector<cv::Mat> lbpHistograms;
             std::vector<cv::Mat> hogDescriptors;
             for (int i = 0; i < images.size(); i++) {
-                auto histogramsForImage = computeRGBHistograms(images[i]);
-                histograms.push_back(histogramsForImage);
-                std::cout << "Computed histograms for image " << i << std::endl;
-                if (i == 0) saveColorHistograms(image1Id, histogramsForImage);
-                else saveColorHistograms(image2Id, histogramsForImage);
+                histograms.push_back(shoeFeatures[i].rgbHistograms);
+                lbpHistograms.push_back(shoeFeatures[i].lbpHistogram);
+                hogDescriptors.push_back(shoeFeatures[i].hogFeatures);
 
-                auto lbpHistogramsForImage = computeLBPHistogram(images[i]);
-                lbpHistograms.push_back(lbpHistogramsForImage);
-                std::cout << "Computed LBP histograms for image " << i << std::endl;
-                if (i == 0) saveLBPFeatures(image1Id, lbpHistogramsForImage);
-                else saveLBPFeatures(image2Id, lbpHistogramsForImage);
-
-                auto hogDescriptorForImage = computeHOGFeatures(images[i]);
-                hogDescriptors.push_back(hogDescriptorForImage);
-                std::cout << "Computed HOG descriptor for image " << i << std::endl;
-                if (i == 0) saveHOGFeatures(image1Id, hogDescriptorForImage);
-                else saveHOGFeatures(image2Id, hogDescriptorForImage);
+                // The features of a shoe are stored together in its feature record
+                if (i == 0) saveShoeProperties(image1Id, histograms[i], lbpHistograms[i], hogDescriptors[i]);
+                else saveShoeProperties(image2Id, histograms[i], lbpHistograms[i], hogDescriptors[i]);
             }
 
             // Extract saved images properties
@@ -396,40 +489,56 @@ int main()
                 return crow::response(imageResponse.statusCode, imageResponse.errorMessage);
             }
 
-            // Preprocess shoe image
-            cv::Mat resizedImage = preprocessImages(image);
+            // Preprocess shoe image: segment it and crop it to the shoe
+            SegmentedShoe segmentedShoe = segmentShoe(image);
 
             // Compute shoe properties
-            ShoeProperties inputShoeFeatures = computeShoeFeatures(resizedImage);
-
-            ShoePropertiesList allShoeProperties = getShoeProperties();
+            FeatureExtractionPipeline pipeline(segmentedShoe);
+            ShoeProperties inputShoeFeatures = pipeline.computeShoeFeatures();
 
             // Compare shoe properties and return most similar pairs of shoes
             // Return vector of id and confidence score for the x most similar pairs
+            // The number of pairs can be set with the "k" url parameter
             int nrPairsToDetect = 5;
-            std::vector<std::pair<int, float>> mostSimilarShoes = compareShoeProperties(allShoeProperties, inputShoeFeatures, nrPairsToDetect);
+            if (req.url_params.get("k") != nullptr) {
+                nrPairsToDetect = std::max(1, std::atoi(req.url_params.get("k")));
+            }
+            // The search mode can be set with the "mode", "candidates", "ef", "nprobe", "n1", "n2" and "bound" url parameters
+            SearchOptions searchOptions = getSearchOptions(req);
+            SearchStatistics searchStatistics;
+            std::vector<std::pair<int, float>> mostSimilarShoes = compareShoeProperties(
+                getShoeFeatureIndex(), inputShoeFeatures, nrPairsToDetect, searchOptions, &searchStatistics);
 
             // Test display most similar shoes
+            std::vector<cv::Mat> similarImages;
             for (int i = 0; i < mostSimilarShoes.size(); i++) {
                 std::cout << "Similar shoe number: " << i+1 << " with id: " << mostSimilarShoes[i].first << " with confidence: " << mostSimilarShoes[i].second << std::endl;
+                similarImages.push_back(getShoeImageByID(mostSimilarShoes[i].first));
+            }
+            if (!similarImages.empty()) {
+                showMats(similarImages, "Most similar shoes");
             }
-            cv::Mat similarImage1 = getShoeImageByID(mostSimilarShoes[0].first);
-            cv::Mat similarImage2 = getShoeImageByID(mostSimilarShoes[1].first);
-            cv::Mat similarImage3 = getShoeImageByID(mostSimilarShoes[2].first);
-            cv::Mat similarImage4 = getShoeImageByID(mostSimilarShoes[3].first);
-            cv::Mat similarImage5 = getShoeImageByID(mostSimilarShoes[4].first);
-            std::vector<cv::Mat> similarImages = {
-                similarImage1,
-                similarImage2,
-                similarImage3,
-                similarImage4,
-                similarImage5
-            };
-            showMats(similarImages, "Most similar shoes");
-
-
 
-            return crow::response("Shoe evaluation completed.");
+            // Return the similar shoes and how many candidates survived each search stage
+            crow::json::wvalue result;
+            std::vector<crow::json::wvalue> similarShoes;
+            for (const auto& [shoeImageId, score] : mostSimilarShoes) {
+                crow::json::wvalue similarShoe;
+                similarShoe["shoeImageId"] = shoeImageId;
+                similarShoe["score"] = score;
+                similarShoes.push_back(std::move(similarShoe));
+            }
+            std::vector<crow::json::wvalue> stages;
+            for (const auto& [stage, survivors] : searchStatistics.stageSurvivors) {
+                crow::json::wvalue searchStage;
+                searchStage["stage"] = stage;
+                searchStage["survivors"] = survivors;
+                stages.push_back(std::move(searchStage));
+            }
+            result["similarShoes"] = std::move(similarShoes);
+            result["stages"] = std::move(stages);
+            result["skippedHOGEvaluations"] = searchStatistics.skippedHOGEvaluations;
+            return crow::response(result);
     });
 
     // POST
@@ -559,22 +668,226 @@ int main()
     });
 
     // GET
-    // Method to recalculate the histograms of each image in database
-    // Input: None
-    // Effects: Recalculates the histograms of each image in the database
+    // Method to recalculate the features of each image in database
+    // Input: optional descriptor profile (profile) and number of shoes bulk loaded at a time (batch)
+    // Effects: replaces the stored features of every shoe image and reloads the resident indexes
     CROW_ROUTE(app, "/recalculate-histograms")
+        .methods(crow::HTTPMethod::Get)([](const crow::request& req){
+            DescriptorProfile profile;
+            try {
+                const char* profileName = req.url_params.get("profile");
+                profile = getDescriptorProfile(profileName ? profileName : defaultDescriptorProfileName);
+            } catch (const std::exception &e) {
+                return crow::response(400, e.what());
+            }
+            const char* batchParam = req.url_params.get("batch");
+            int batchSize = batchParam ? std::atoi(batchParam) : 2000;
+
+            int nrOfRecalculatedShoes = 0;
+            try {
+                nrOfRecalculatedShoes = recalculateShoeFeatures(profile, batchSize);
+
+                // Only the default profile is indexed, the colours are shared by every profile
+                if (profile.name == defaultDescriptorProfileName) {
+                    getShoeFeatureIndex().load();
+                }
+                getDominantColorIndex().load(getShoeImagesWithDominantColors());
+                getShoeColorGrid().load(getShoeColors());
+            } catch (const std::exception &e) {
+                CROW_LOG_ERROR << e.what();
+                return crow::response(500, e.what());
+            }
+
+            return crow::response("Recalculated the " + profile.name + " features of " + std::to_string(nrOfRecalculatedShoes) + " shoes");
+    });
+
+    // GET
+    // Method to compute the dominant colors of every shoe image that has none yet
+    // Effects: saves the dominant colors to the database and the resident color index
+    CROW_ROUTE(app, "/backfill-dominant-colors")
+        .methods(crow::HTTPMethod::Get)([](){
+            int nrOfBackfilledShoes = 0;
+            try {
+                nrOfBackfilledShoes = backfillDominantColors();
+            } catch (const std::exception &e) {
+                CROW_LOG_ERROR << e.what();
+                return crow::response(500, e.what());
+            }
+
+            return crow::response("Backfilled the dominant colors of " + std::to_string(nrOfBackfilledShoes) + " shoes");
+    });
+
+    // GET
+    // Method to store a feature record for every shoe whose features are only in the separate feature tables,
+    // which are no longer written
+    // Input: optional descriptor profile (profile), the legacy profile of the rows stored before profiles existed by default
+    // Effects: saves the feature records to the database, with the default profile also reloads the resident feature index from them
+    CROW_ROUTE(app, "/backfill-feature-records")
+        .methods(crow::HTTPMethod::Get)([](const crow::request& req){
+            const char* profileParameter = req.url_params.get("profile");
+            std::string profileName = profileParameter ? profileParameter : legacyDescriptorProfileName;
+            if (profileName != legacyDescriptorProfileName) {
+                try {
+                    getDescriptorProfile(profileName);
+                } catch (const std::exception &e) {
+                    return crow::response(400, e.what());
+                }
+            }
+
+            int nrOfBackfilledShoes = 0;
+            try {
+                nrOfBackfilledShoes = backfillFeatureRecords(profileName);
+                if (profileName == defaultDescriptorProfileName) {
+                    getShoeFeatureIndex().load();
+                }
+            } catch (const std::exception &e) {
+                CROW_LOG_ERROR << e.what();
+                return crow::response(500, e.what());
+            }
+
+            return crow::response("Stored the " + profileName + " feature records of " + std::to_string(nrOfBackfilledShoes) + " shoes");
+    });
+
+    // GET
+    // Method to reload the resident feature index from the database
+    // Effects: replaces the indexed features with the stored feature records
+    CROW_ROUTE(app, "/reload-feature-index")
         .methods(crow::HTTPMethod::Get)([](){
             try {
-                // recalculateHistograms();
+                getShoeFeatureIndex().load();
+            } catch (const std::exception &e) {
+                CROW_LOG_ERROR << e.what();
+                return crow::response(500, e.what());
+            }
+
+            return crow::response("Reloaded " + std::to_string(getShoeFeatureIndex().size()) + " shoes into the feature index");
+    });
+
+    // GET
+    // Method to train the compressed IVF-PQ index on the features stored in the database
+    // Effects: saves the trained index to disk and uses it for /evaluate?mode=ivfpq, or for every mode with SHOES_IVFPQ_CODES_ONLY
+    CROW_ROUTE(app, "/train-ivfpq-index")
+        .methods(crow::HTTPMethod::Get)([](){
+            size_t nrOfShoes = 0;
+            try {
+                std::shared_ptr<const HOGProjection> hogProjection = getShoeFeatureIndex().getHOGProjection();
+                std::unique_ptr<IVFPQIndex> ivfpq = trainIVFPQIndex(IVFPQParameters(), hogProjection.get());
+                ivfpq->save(defaultIVFPQIndexPath);
+                nrOfShoes = ivfpq->size();
+                getShoeFeatureIndex().setIVFPQIndex(std::move(ivfpq));
+                // Drop the resident full precision features now that the codes cover every shoe
+                if (isIVFPQCodesOnlyConfigured()) {
+                    getShoeFeatureIndex().load();
+                }
+            } catch (const std::exception &e) {
+                CROW_LOG_ERROR << e.what();
+                return crow::response(500, e.what());
+            }
+
+            return crow::response("Trained IVF-PQ index on " + std::to_string(nrOfShoes) + " shoes");
+    });
+
+    // GET
+    // Method to fit a PCA projection on the stored HOG features
+    // Input: url params dimension (default 128) and whiten (0 or 1, default 0)
+    // Effects: stores the reduced HOG features of every shoe, saves the projection to disk and reloads the feature index with it
+    // Output: recall report of the projected ranking against the raw ranking
+    CROW_ROUTE(app, "/train-hog-projection")
+        .methods(crow::HTTPMethod::Get)([](const crow::request& req){
+            HOGProjectionParameters parameters;
+            if (req.url_params.get("dimension") != nullptr) {
+                parameters.dimension = std::atoi(req.url_params.get("dimension"));
+            }
+            if (req.url_params.get("whiten") != nullptr) {
+                parameters.whiten = std::atoi(req.url_params.get("whiten")) != 0;
+            }
+            if (parameters.dimension <= 0) {
+                return crow::response(400, "dimension must be positive");
+            }
+
+            HOGProjectionRecall report;
+            try {
+                std::shared_ptr<HOGProjection> hogProjection = trainHOGProjection(parameters);
+                hogProjection->save(defaultHOGProjectionPath);
+                report = reportHOGProjectionRecall(*hogProjection);
+                getShoeFeatureIndex().setHOGProjection(hogProjection);
+                getShoeFeatureIndex().load();
             } catch (const std::exception &e) {
                 CROW_LOG_ERROR << e.what();
+                return crow::response(500, e.what());
             }
 
-            return "Recalculated histograms";
+            return crow::response(hogProjectionRecallToJson(report));
+    });
+
+    // GET
+    // Method to report the ranking impact of the HOG projection used by the feature index
+    // Input: url params queries (default 100) and k (default 10)
+    // Output: recall@k of the projected ranking against the raw ranking, and the scoring time of both
+    CROW_ROUTE(app, "/hog-projection-recall")
+        .methods(crow::HTTPMethod::Get)([](const crow::request& req){
+            const char* nrOfQueriesParam = req.url_params.get("queries");
+            const char* kParam = req.url_params.get("k");
+            int nrOfQueries = nrOfQueriesParam ? std::atoi(nrOfQueriesParam) : 100;
+            int k = kParam ? std::atoi(kParam) : 10;
+            if (nrOfQueries <= 0 || k <= 0) {
+                return crow::response(400, "queries and k must be positive");
+            }
+
+            std::shared_ptr<const HOGProjection> hogProjection = getShoeFeatureIndex().getHOGProjection();
+            if (!hogProjection) {
+                return crow::response(404, "No HOG projection loaded, fit one with /train-hog-projection");
+            }
+
+            HOGProjectionRecall report;
+            try {
+                report = reportHOGProjectionRecall(*hogProjection, nrOfQueries, k);
+            } catch (const std::exception &e) {
+                CROW_LOG_ERROR << e.what();
+                return crow::response(500, e.what());
+            }
+
+            return crow::response(hogProjectionRecallToJson(report));
+    });
+
+    // GET
+    // Method to compare the cost and quality of the descriptor profiles on a sample of the stored shoe images
+    // Input: url params shoes (sample size, default 200) and k (default 5)
+    // Output: per profile the bytes per shoe, extraction and scoring time, and recall@k against the default profile
+    CROW_ROUTE(app, "/benchmark-descriptor-profiles")
+        .methods(crow::HTTPMethod::Get)([](const crow::request& req){
+            const char* nrOfShoesParam = req.url_params.get("shoes");
+            const char* kParam = req.url_params.get("k");
+            int nrOfShoes = nrOfShoesParam ? std::atoi(nrOfShoesParam) : 200;
+            int k = kParam ? std::atoi(kParam) : 5;
+            if (nrOfShoes <= 1 || k <= 0) {
+                return crow::response(400, "shoes must be larger than 1 and k must be positive");
+            }
+
+            std::vector<DescriptorProfileBenchmark> benchmarks;
+            try {
+                benchmarks = benchmarkDescriptorProfiles(getShoeImageIds(nrOfShoes), k);
+            } catch (const std::exception &e) {
+                CROW_LOG_ERROR << e.what();
+                return crow::response(500, e.what());
+            }
+
+            crow::json::wvalue response;
+            for (size_t i = 0; i < benchmarks.size(); i++) {
+                response["profiles"][i]["profile"] = benchmarks[i].profile;
+                response["profiles"][i]["rgbBins"] = benchmarks[i].rgbBins;
+                response["profiles"][i]["lbpBins"] = benchmarks[i].lbpBins;
+                response["profiles"][i]["bytesPerShoe"] = benchmarks[i].bytesPerShoe;
+                response["profiles"][i]["extractionMilliseconds"] = benchmarks[i].extractionMilliseconds;
+                response["profiles"][i]["scoringMicroseconds"] = benchmarks[i].scoringMicroseconds;
+                response["profiles"][i]["recallAtK"] = benchmarks[i].recallAtK;
+            }
+            response["k"] = k;
+            return crow::response(response);
     });
 
     CROW_ROUTE(app, "/test-db")
-        .methods(crow::HTTPMethod::Get)([](){ // Capture the 'conn' variable in the lambda's capture list
+        .methods(crow::HTTPMethod::Get)([](){
             try {
                 // testGetShoeMetadata();
             } catch (const std::exception &e) {
@@ -0,0 +1,333 @@
+#ifndef COLOR_INDEX_H
+#define COLOR_INDEX_H
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "compute.h"
+#include "top_k.h"
+
+// Process-wide, resident copy of the evaluate_shoedominantcolor table for colour-only search.
+// Every shoe has a fixed-width signature of maxDominantColors colour slots. The signatures are
+// stored in blocks of shoesPerBlock shoes, each block holding one plane of shoesPerBlock values
+// per slot and channel, so the distance kernel processes a whole block with vector instructions.
+struct DominantColorIndex {
+    static constexpr int maxDominantColors = 8;
+    static constexpr int shoesPerBlock = 16;
+
+    // Planes of a colour slot: blue, green and red value, frequency percentage and whether the slot is used
+    enum SlotPlane { BluePlane, GreenPlane, RedPlane, PercentagePlane, UsedPlane, NrOfSlotPlanes };
+    static constexpr int floatsPerBlock = maxDominantColors * NrOfSlotPlanes * shoesPerBlock;
+
+    // Replace the index content, typically with the result of getShoeImagesWithDominantColors()
+    void load(const std::map<int, std::vector<DominantColor>>& shoeDominantColors) {
+        std::vector<int> loadedShoeImageIds;
+        std::vector<float> loadedBlocks;
+        std::unordered_map<int, size_t> loadedShoeByImageId;
+        for (const auto& [shoeImageId, dominantColors] : shoeDominantColors) {
+            size_t shoe = loadedShoeImageIds.size();
+            loadedShoeImageIds.push_back(shoeImageId);
+            loadedShoeByImageId[shoeImageId] = shoe;
+            if (shoe % shoesPerBlock == 0) {
+                loadedBlocks.resize(loadedBlocks.size() + floatsPerBlock, 0.0f);
+            }
+            writeSignature(loadedBlocks, shoe, dominantColors);
+        }
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        shoeImageIds = std::move(loadedShoeImageIds);
+        blocks = std::move(loadedBlocks);
+        shoeByImageId = std::move(loadedShoeByImageId);
+    }
+
+    // Add the dominant colours of a shoe image, or replace them if the id is already indexed
+    void add(int shoeImageId, const std::vector<DominantColor>& dominantColors) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+
+        auto existingShoe = shoeByImageId.find(shoeImageId);
+        if (existingShoe != shoeByImageId.end()) {
+            writeSignature(blocks, existingShoe->second, dominantColors);
+            return;
+        }
+
+        size_t shoe = shoeImageIds.size();
+        shoeImageIds.push_back(shoeImageId);
+        shoeByImageId[shoeImageId] = shoe;
+        if (shoe % shoesPerBlock == 0) {
+            blocks.resize(blocks.size() + floatsPerBlock, 0.0f);
+        }
+        writeSignature(blocks, shoe, dominantColors);
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return shoeImageIds.size();
+    }
+
+    // The nrOfSimilarShoes shoes with the smallest colour distance to the input colours, closest first.
+    // The distance of a shoe is the sum over its dominant colours of the L2 distance to the closest input colour.
+    std::vector<std::pair<int, float>> search(const std::vector<DominantColor>& inputColors, int nrOfSimilarShoes) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        std::vector<std::pair<int, float>> similarShoeImages;
+        if (inputColors.empty() || shoeImageIds.empty()) {
+            return similarShoeImages;
+        }
+
+        size_t nrOfBlocks = blocks.size() / floatsPerBlock;
+        size_t nrOfPartitions = std::max<size_t>(1, std::min<size_t>(cv::getNumThreads(), nrOfBlocks / 16));
+        size_t blocksPerPartition = (nrOfBlocks + nrOfPartitions - 1) / nrOfPartitions;
+
+        // Distances are negated, so the bounded heap keeps the closest shoes
+        std::vector<TopKShoes> partitionResults(nrOfPartitions, TopKShoes(nrOfSimilarShoes));
+        cv::parallel_for_(cv::Range(0, (int)nrOfPartitions), [&](const cv::Range& partitions) {
+            float distances[shoesPerBlock];
+            for (int partition = partitions.start; partition < partitions.end; partition++) {
+                size_t beginBlock = partition * blocksPerPartition;
+                size_t endBlock = std::min(nrOfBlocks, beginBlock + blocksPerPartition);
+                for (size_t block = beginBlock; block < endBlock; block++) {
+                    computeBlockDistances(blocks.data() + block * floatsPerBlock, inputColors, distances);
+
+                    size_t firstShoe = block * shoesPerBlock;
+                    size_t lastShoe = std::min(shoeImageIds.size(), firstShoe + shoesPerBlock);
+                    for (size_t shoe = firstShoe; shoe < lastShoe; shoe++) {
+                        partitionResults[partition].push(shoeImageIds[shoe], -distances[shoe - firstShoe]);
+                    }
+                }
+            }
+        }, (double)nrOfPartitions);
+
+        TopKShoes closestShoeImages(nrOfSimilarShoes);
+        for (const TopKShoes& partitionResult : partitionResults) {
+            closestShoeImages.merge(partitionResult);
+        }
+        for (const auto& [shoeImageId, negatedDistance] : closestShoeImages.sorted()) {
+            similarShoeImages.emplace_back(shoeImageId, -negatedDistance);
+        }
+        return similarShoeImages;
+    }
+
+private:
+    static float* planeOf(float* block, int slot, int plane) {
+        return block + (slot * NrOfSlotPlanes + plane) * shoesPerBlock;
+    }
+
+    static const float* planeOf(const float* block, int slot, int plane) {
+        return block + (slot * NrOfSlotPlanes + plane) * shoesPerBlock;
+    }
+
+    static void writeSignature(std::vector<float>& signatureBlocks, size_t shoe, const std::vector<DominantColor>& dominantColors) {
+        if ((int)dominantColors.size() > maxDominantColors) {
+            std::cerr << "Only the first " << maxDominantColors << " of " << dominantColors.size() << " dominant colors are indexed" << std::endl;
+        }
+
+        float* block = signatureBlocks.data() + shoe / shoesPerBlock * floatsPerBlock;
+        size_t lane = shoe % shoesPerBlock;
+        for (int slot = 0; slot < maxDominantColors; slot++) {
+            bool isUsed = slot < (int)dominantColors.size();
+            for (int channel = 0; channel < 3; channel++) {
+                planeOf(block, slot, BluePlane + channel)[lane] = isUsed ? dominantColors[slot].color[channel] : 0.0f;
+            }
+            planeOf(block, slot, PercentagePlane)[lane] = isUsed ? dominantColors[slot].percentage : 0.0f;
+            planeOf(block, slot, UsedPlane)[lane] = isUsed ? 1.0f : 0.0f;
+        }
+    }
+
+    // Colour distance of every shoe of a block, vectorized over the shoes
+    static void computeBlockDistances(const float* block, const std::vector<DominantColor>& inputColors, float* distances) {
+        std::fill(distances, distances + shoesPerBlock, 0.0f);
+        for (int slot = 0; slot < maxDominantColors; slot++) {
+            const float* blue = planeOf(block, slot, BluePlane);
+            const float* green = planeOf(block, slot, GreenPlane);
+            const float* red = planeOf(block, slot, RedPlane);
+            const float* used = planeOf(block, slot, UsedPlane);
+
+            float minimumSquaredDistances[shoesPerBlock];
+            std::fill(minimumSquaredDistances, minimumSquaredDistances + shoesPerBlock, std::numeric_limits<float>::max());
+            for (const DominantColor& inputColor : inputColors) {
+                const float inputBlue = inputColor.color[0];
+                const float inputGreen = inputColor.color[1];
+                const float inputRed = inputColor.color[2];
+#pragma omp simd
+                for (int lane = 0; lane < shoesPerBlock; lane++) {
+                    float blueDifference = blue[lane] - inputBlue;
+                    float greenDifference = green[lane] - inputGreen;
+                    float redDifference = red[lane] - inputRed;
+                    float squaredDistance = blueDifference * blueDifference + greenDifference * greenDifference + redDifference * redDifference;
+                    minimumSquaredDistances[lane] = std::min(minimumSquaredDistances[lane], squaredDistance);
+                }
+            }
+
+#pragma omp simd
+            for (int lane = 0; lane < shoesPerBlock; lane++) {
+                distances[lane] += used[lane] * std::sqrt(minimumSquaredDistances[lane]);
+            }
+        }
+    }
+
+    mutable std::shared_mutex mutex;
+    std::vector<int> shoeImageIds;
+    std::vector<float> blocks;
+    std::unordered_map<int, size_t> shoeByImageId;
+};
+
+// Resident uniform grid over the (red, green, blue) percentage triples of evaluate_shoeproperties.
+// Percentages lie in [0, 100], so a fixed grid of cellSize wide cubes covers every shoe and a
+// nearest neighbour query only visits the cells around the query colour.
+struct ShoeColorGrid {
+    static constexpr float cellSize = 5.0f;
+    static constexpr int cellsPerAxis = (int)(100.0f / cellSize);
+
+    // Replace the grid content, typically with the result of getShoeColors()
+    void load(const std::vector<std::pair<int, ShoeColor>>& shoeColors) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        cells.assign(cellsPerAxis * cellsPerAxis * cellsPerAxis, {});
+        colorByShoeImageId.clear();
+        for (const auto& [shoeImageId, shoeColor] : shoeColors) {
+            insert(shoeImageId, shoeColor);
+        }
+    }
+
+    // Add the mean colour of a shoe image, or move it if the id is already indexed
+    void add(int shoeImageId, const ShoeColor& shoeColor) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        if (cells.empty()) {
+            cells.assign(cellsPerAxis * cellsPerAxis * cellsPerAxis, {});
+        }
+        insert(shoeImageId, shoeColor);
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return colorByShoeImageId.size();
+    }
+
+    // The k shoes whose colour is closest to the given colour, closest first, with their distances.
+    // Rings of cells around the query cell are visited until no unvisited cell can hold a closer shoe.
+    std::vector<std::pair<int, float>> nearest(const ShoeColor& shoeColor, int k) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        std::vector<std::pair<int, float>> closestShoeImages;
+        if (colorByShoeImageId.empty() || k <= 0) {
+            return closestShoeImages;
+        }
+
+        // Distances are negated, so the bounded heap keeps the closest shoes
+        TopKShoes closestShoes(k);
+        const int queryCell[3] = {cellOf(shoeColor.red), cellOf(shoeColor.green), cellOf(shoeColor.blue)};
+        for (int ring = 0; ring < cellsPerAxis; ring++) {
+            visitCells(queryCell, ring, ring, [&](const std::vector<int>& cell) {
+                for (int shoeImageId : cell) {
+                    closestShoes.push(shoeImageId, -distance(shoeColor, colorByShoeImageId.at(shoeImageId)));
+                }
+            });
+
+            // Every shoe outside the visited rings is at least ring * cellSize away
+            if (closestShoes.isFull() && -closestShoes.threshold() <= ring * cellSize) {
+                break;
+            }
+        }
+
+        for (const auto& [shoeImageId, negatedDistance] : closestShoes.sorted()) {
+            closestShoeImages.emplace_back(shoeImageId, -negatedDistance);
+        }
+        return closestShoeImages;
+    }
+
+    // Every shoe whose colour is within radius of the given colour, closest first, with their distances
+    std::vector<std::pair<int, float>> withinRadius(const ShoeColor& shoeColor, float radius) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        std::vector<std::pair<int, float>> closeShoeImages;
+        if (colorByShoeImageId.empty() || radius < 0) {
+            return closeShoeImages;
+        }
+
+        const int queryCell[3] = {cellOf(shoeColor.red), cellOf(shoeColor.green), cellOf(shoeColor.blue)};
+        int maxRing = std::min(cellsPerAxis - 1, (int)std::ceil(radius / cellSize));
+        visitCells(queryCell, 0, maxRing, [&](const std::vector<int>& cell) {
+            for (int shoeImageId : cell) {
+                float shoeDistance = distance(shoeColor, colorByShoeImageId.at(shoeImageId));
+                if (shoeDistance <= radius) {
+                    closeShoeImages.emplace_back(shoeImageId, shoeDistance);
+                }
+            }
+        });
+
+        std::sort(closeShoeImages.begin(), closeShoeImages.end(), [](const std::pair<int, float>& a, const std::pair<int, float>& b) {
+            return a.second < b.second;
+        });
+        return closeShoeImages;
+    }
+
+private:
+    static int cellOf(float percentage) {
+        return std::clamp((int)(percentage / cellSize), 0, cellsPerAxis - 1);
+    }
+
+    static float distance(const ShoeColor& first, const ShoeColor& second) {
+        float redDifference = first.red - second.red;
+        float greenDifference = first.green - second.green;
+        float blueDifference = first.blue - second.blue;
+        return std::sqrt(redDifference * redDifference + greenDifference * greenDifference + blueDifference * blueDifference);
+    }
+
+    std::vector<int>& cellAt(int red, int green, int blue) {
+        return cells[(red * cellsPerAxis + green) * cellsPerAxis + blue];
+    }
+
+    const std::vector<int>& cellAt(int red, int green, int blue) const {
+        return cells[(red * cellsPerAxis + green) * cellsPerAxis + blue];
+    }
+
+    // Visit the cells whose Chebyshev distance to the centre cell lies in [minRing, maxRing]
+    template <typename VisitCell>
+    void visitCells(const int* centre, int minRing, int maxRing, VisitCell visitCell) const {
+        for (int red = std::max(0, centre[0] - maxRing); red <= std::min(cellsPerAxis - 1, centre[0] + maxRing); red++) {
+            for (int green = std::max(0, centre[1] - maxRing); green <= std::min(cellsPerAxis - 1, centre[1] + maxRing); green++) {
+                for (int blue = std::max(0, centre[2] - maxRing); blue <= std::min(cellsPerAxis - 1, centre[2] + maxRing); blue++) {
+                    int ring = std::max({std::abs(red - centre[0]), std::abs(green - centre[1]), std::abs(blue - centre[2])});
+                    if (ring >= minRing) {
+                        visitCell(cellAt(red, green, blue));
+                    }
+                }
+            }
+        }
+    }
+
+    void insert(int shoeImageId, const ShoeColor& shoeColor) {
+        auto existingColor = colorByShoeImageId.find(shoeImageId);
+        if (existingColor != colorByShoeImageId.end()) {
+            const ShoeColor& oldColor = existingColor->second;
+            std::vector<int>& oldCell = cellAt(cellOf(oldColor.red), cellOf(oldColor.green), cellOf(oldColor.blue));
+            oldCell.erase(std::remove(oldCell.begin(), oldCell.end(), shoeImageId), oldCell.end());
+        }
+
+        colorByShoeImageId[shoeImageId] = shoeColor;
+        cellAt(cellOf(shoeColor.red), cellOf(shoeColor.green), cellOf(shoeColor.blue)).push_back(shoeImageId);
+    }
+
+    mutable std::shared_mutex mutex;
+    // Shoe image ids per cell, indexed by (red cell * cellsPerAxis + green cell) * cellsPerAxis + blue cell
+    std::vector<std::vector<int>> cells;
+    std::unordered_map<int, ShoeColor> colorByShoeImageId;
+};
+
+// Single colour index shared by all request threads
+DominantColorIndex& getDominantColorIndex() {
+    static DominantColorIndex dominantColorIndex;
+    return dominantColorIndex;
+}
+
+// Single mean colour grid shared by all request threads
+ShoeColorGrid& getShoeColorGrid() {
+    static ShoeColorGrid shoeColorGrid;
+    return shoeColorGrid;
+}
+
+#endif // COLOR_INDEX_H
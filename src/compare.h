@@ -1,100 +1,33 @@
 #ifndef COMPARE_H
 #define COMPARE_H
 
+#include "color_index.h"
 #include "database_features.h"
 #include "database_shoes.h"
+#include "feature_index.h"
+#include "feature_matrix.h"
+#include "top_k.h"
+#include <memory>
+#include <numeric>
+#include <unordered_set>
 
 
 // Return an ordered list of the most similar shoe images with their similarity scores
-// based on dominant colors
-std::vector<std::pair<int, float>> getShoeImagesWithSimilarDominantColors(std::vector<DominantColor> inputColors) {
-    std::vector<std::pair<int, float>> shoeImages;
-
-    // Get all images and respective dominant colors
-    std::map<int, std::vector<DominantColor>> shoeDominantColors = getShoeImagesWithDominantColors();
-
-    // Compare dominant colors
-    for (const auto& [shoeImageId, dominantColors] : shoeDominantColors) {
-        // Associate the most similar dominant colors with the input colors
-        // Obtain pairs of dominant colors
-        std::vector<DominantColor> inputColorsCopy = inputColors;
-        std::vector<std::pair<DominantColor, DominantColor>> dominantColorPairs;
-        for (DominantColor dominantColor : dominantColors) {
-            float minimumDistance = std::numeric_limits<float>::max();
-            DominantColor mostSimilarInputDominantColor;
-            for (DominantColor inputColor : inputColors) {
-                float distance = cv::norm(dominantColor.color, inputColor.color);
-                if (distance < minimumDistance) {
-                    minimumDistance = distance;
-                    mostSimilarInputDominantColor = inputColor;
-                }
-            }
-
-            // Add the pair to the list
-            dominantColorPairs.push_back(std::make_pair(dominantColor, mostSimilarInputDominantColor));
-            inputColorsCopy.erase(
-                std::remove(inputColorsCopy.begin(),
-                    inputColorsCopy.end(), mostSimilarInputDominantColor), inputColorsCopy.end()
-            );
-        }
-
-        // Compute similarity score, taking into account the frequency of the dominant colors
-        // The bigger the difference in frequency, the bigger the totalDifference
-        float totalDifference = 0.0;
-        for (const auto& [dominantColor, mostSimilarInputDominantColor] : dominantColorPairs) {
-            // float frequencyDifference;
-            // if (dominantColor.percentage > mostSimilarInputDominantColor.percentage)
-            //     frequencyDifference = dominantColor.percentage / mostSimilarInputDominantColor.percentage;
-            // else
-            //     frequencyDifference = mostSimilarInputDominantColor.percentage / dominantColor.percentage;
-
-            totalDifference += cv::norm(dominantColor.color, mostSimilarInputDominantColor.color);
-        }
-
-        shoeImages.push_back(std::make_pair(shoeImageId, totalDifference));
-    }
-
-    // Sort the shoe images by similarity score
-    std::sort(shoeImages.begin(), shoeImages.end(), [](const std::pair<int, float>& a, const std::pair<int, float>& b) {
-        return a.second < b.second;
-    });
-
-
-    return shoeImages;
+// based on dominant colors, searched in the resident dominant color index
+std::vector<std::pair<int, float>> getShoeImagesWithSimilarDominantColors(const std::vector<DominantColor>& inputColors, int nrOfSimilarShoes = 5) {
+    return getDominantColorIndex().search(inputColors, nrOfSimilarShoes);
 }
 
-// Function to add a id, confidence_score pair to a sorted vector of pairs.
-// Also checks if vector size is less than the max input size.
-void addShoeImageToVector(std::vector<std::pair<int, float>>& shoeImages, std::pair<int, float> shoeImage, int maxInputSize = 5) {
-    if (shoeImages.empty()) {
-        shoeImages.push_back(shoeImage);
-        return;
-    }
-
-    bool isShoeImageVectorFilled = shoeImages.size() >= maxInputSize;
-
-    for (int i = 0; i < shoeImages.size(); i++) {
-        if (shoeImage.second > shoeImages[i].second) {
-            shoeImages.insert(shoeImages.begin() + i, shoeImage);
-            if (isShoeImageVectorFilled) {
-                shoeImages.pop_back();
-            }
-            return;
-        }
-    }
-}
-
-
 // Return an ordered list of the most similar shoe images with their id and similarity score
 std::vector<std::pair<int, float>> compareShoeProperties(
-    ShoePropertiesList allShoesProperties,
-    ShoeProperties inputShoeFeatures,
+    const ShoePropertiesList& allShoesProperties,
+    const ShoeProperties& inputShoeFeatures,
     int nrOfSimilarShoes = 5
 ) {
-    std::vector<int> shoeImageIds = allShoesProperties.shoeImageIds;
-    std::vector<std::vector<cv::Mat>> rgbHistograms = allShoesProperties.RGBHistograms;
-    std::vector<cv::Mat> lbpHistogram = allShoesProperties.LBPHistograms;
-    std::vector<cv::Mat> hogFeatures = allShoesProperties.HOGFeatures;
+    const std::vector<int>& shoeImageIds = allShoesProperties.shoeImageIds;
+    const std::vector<std::vector<cv::Mat>>& rgbHistograms = allShoesProperties.RGBHistograms;
+    const std::vector<cv::Mat>& lbpHistogram = allShoesProperties.LBPHistograms;
+    const std::vector<cv::Mat>& hogFeatures = allShoesProperties.HOGFeatures;
 
     // std::cout << "Shoe Image IDs size: " << shoeImageIds.size() << std::endl;
     // std::cout << "RGB Histograms size: " << rgbHistograms.size() << std::endl;
@@ -102,7 +35,7 @@ std::vector<std::pair<int, float>> compareShoeProperties(
     // std::cout << "HOG Features size: " << hogFeatures.size() << std::endl;
 
 
-    std::vector<std::pair<int, float>> similarShoeImages;
+    TopKShoes similarShoeImages(nrOfSimilarShoes);
 
     // Compare shoe properties
     double weightRGB = 0.3;
@@ -143,7 +76,7 @@ std::vector<std::pair<int, float>> compareShoeProperties(
             weightLBP * lbpCorrelation +
             weightHOG * hogCorrelation;
 
-        addShoeImageToVector(similarShoeImages, std::make_pair(shoeImageIds[i], totalCorrelation), nrOfSimilarShoes);
+        similarShoeImages.push(shoeImageIds[i], totalCorrelation);
 
         if (totalCorrelation > maximumCorrelation) {
             maximumCorrelation = totalCorrelation;
@@ -191,7 +124,378 @@ std::vector<std::pair<int, float>> compareShoeProperties(
     // showMat(hogCorrelationImage, "Most correlated HOG shoe");
     // std::cout << "Most correlated shoe: " << mostCorrelatedShoe << std::endl;
 
+    return similarShoeImages.sorted();
+}
+
+// Minimum number of rows a worker scores, below it splitting the scan costs more than it saves
+constexpr size_t minRowsPerPartition = 256;
+
+// Return the nrOfSimilarShoes best scoring rows of the feature matrix, most similar first.
+// The rows are split into one partition per worker thread, every partition keeps its own
+// bounded top-k heap and the heaps are merged at the end.
+std::vector<std::pair<int, float>> findMostSimilarShoes(
+    const FeatureMatrix& features,
+    const FeatureQuery& query,
+    int nrOfSimilarShoes
+) {
+    size_t nrOfRows = features.rows();
+    size_t nrOfPartitions = std::max<size_t>(1, std::min<size_t>(cv::getNumThreads(), nrOfRows / minRowsPerPartition));
+    size_t rowsPerPartition = (nrOfRows + nrOfPartitions - 1) / nrOfPartitions;
+
+    std::vector<TopKShoes> partitionResults(nrOfPartitions, TopKShoes(nrOfSimilarShoes));
+    cv::parallel_for_(cv::Range(0, (int)nrOfPartitions), [&](const cv::Range& partitions) {
+        std::vector<float> scores(rowsPerPartition);
+        for (int partition = partitions.start; partition < partitions.end; partition++) {
+            size_t begin = partition * rowsPerPartition;
+            size_t end = std::min(nrOfRows, begin + rowsPerPartition);
+            scoreFeatureRows(features, query, begin, end, scores.data());
+
+            for (size_t i = begin; i < end; i++) {
+                partitionResults[partition].push(features.shoeImageIds[i], scores[i - begin]);
+            }
+        }
+    }, (double)nrOfPartitions);
+
+    TopKShoes similarShoeImages(nrOfSimilarShoes);
+    for (const TopKShoes& partitionResult : partitionResults) {
+        similarShoeImages.merge(partitionResult);
+    }
+    return similarShoeImages.sorted();
+}
+
+// Number of candidates left after each stage of a search, reported back to the client
+struct SearchStatistics {
+    std::vector<std::pair<std::string, size_t>> stageSurvivors;
+    // Rows whose HOG term was never computed because their score bound couldn't make the top k
+    size_t skippedHOGEvaluations = 0;
+};
+
+// Exact top-k scan that skips the HOG term of rows that can't make it into the result.
+// The RGB and LBP terms are scored first; the HOG term can add at most the norm of the weighted
+// query HOG segment (Cauchy-Schwarz, stored segments have a norm of at most 1), so a row whose
+// partial score plus that bound doesn't beat the k-th best score of its partition is dropped.
+std::vector<std::pair<int, float>> boundedMostSimilarShoes(
+    const FeatureMatrix& features,
+    const FeatureQuery& query,
+    int nrOfSimilarShoes,
+    SearchStatistics* statistics = nullptr
+) {
+    const FeatureLayout& layout = features.layout;
+    const float* weightedQuery = query.weightedValues.get();
+    const float* weightedHOGQuery = weightedQuery + layout.offsets[HOGSegment];
+    const int hogSize = layout.sizes[HOGSegment];
+    // Slack for the rounding of the float dot products, so pruning never changes the result
+    const float hogBound = std::sqrt(dotProduct(weightedHOGQuery, weightedHOGQuery, hogSize)) + 1e-5f;
+
+    size_t nrOfRows = features.rows();
+    size_t nrOfPartitions = std::max<size_t>(1, std::min<size_t>(cv::getNumThreads(), nrOfRows / minRowsPerPartition));
+    size_t rowsPerPartition = (nrOfRows + nrOfPartitions - 1) / nrOfPartitions;
+
+    std::vector<TopKShoes> partitionResults(nrOfPartitions, TopKShoes(nrOfSimilarShoes));
+    std::vector<size_t> partitionSkippedHOG(nrOfPartitions, 0);
+    cv::parallel_for_(cv::Range(0, (int)nrOfPartitions), [&](const cv::Range& partitions) {
+        for (int partition = partitions.start; partition < partitions.end; partition++) {
+            TopKShoes& partitionResult = partitionResults[partition];
+            size_t begin = partition * rowsPerPartition;
+            size_t end = std::min(nrOfRows, begin + rowsPerPartition);
+            for (size_t i = begin; i < end; i++) {
+                const float* row = features.row(i);
+                float partialScore = dotProduct(row, weightedQuery, layout.offsets[HOGSegment]);
+                if (partitionResult.isFull() && partialScore + hogBound <= partitionResult.threshold()) {
+                    partitionSkippedHOG[partition]++;
+                    continue;
+                }
+                float hogScore = dotProduct(row + layout.offsets[HOGSegment], weightedHOGQuery, hogSize);
+                partitionResult.push(features.shoeImageIds[i], partialScore + hogScore);
+            }
+        }
+    }, (double)nrOfPartitions);
+
+    TopKShoes similarShoeImages(nrOfSimilarShoes);
+    for (const TopKShoes& partitionResult : partitionResults) {
+        similarShoeImages.merge(partitionResult);
+    }
+
+    if (statistics != nullptr) {
+        statistics->stageSurvivors = {{"indexed", nrOfRows}};
+        statistics->skippedHOGEvaluations = std::accumulate(partitionSkippedHOG.begin(), partitionSkippedHOG.end(), (size_t)0);
+    }
+    return similarShoeImages.sorted();
+}
+
+// Return the nrOfRows best scoring rows among the candidate rows (every row when candidateRows is null)
+// with their scores, best first. Partitions of the candidates are scored in parallel, each with its own bounded heap.
+template <typename ScoreRow>
+std::vector<std::pair<size_t, float>> findBestRows(size_t nrOfRows, const std::vector<size_t>* candidateRows, int nrOfBestRows, ScoreRow scoreRow) {
+    size_t nrOfCandidates = candidateRows ? candidateRows->size() : nrOfRows;
+    size_t nrOfPartitions = std::max<size_t>(1, std::min<size_t>(cv::getNumThreads(), nrOfCandidates / minRowsPerPartition));
+    size_t candidatesPerPartition = (nrOfCandidates + nrOfPartitions - 1) / nrOfPartitions;
+
+    std::vector<TopKShoes> partitionResults(nrOfPartitions, TopKShoes(nrOfBestRows));
+    cv::parallel_for_(cv::Range(0, (int)nrOfPartitions), [&](const cv::Range& partitions) {
+        for (int partition = partitions.start; partition < partitions.end; partition++) {
+            size_t begin = partition * candidatesPerPartition;
+            size_t end = std::min(nrOfCandidates, begin + candidatesPerPartition);
+            for (size_t i = begin; i < end; i++) {
+                size_t row = candidateRows ? (*candidateRows)[i] : i;
+                partitionResults[partition].push((int)row, (float)scoreRow(row));
+            }
+        }
+    }, (double)nrOfPartitions);
+
+    TopKShoes bestRows(nrOfBestRows);
+    for (const TopKShoes& partitionResult : partitionResults) {
+        bestRows.merge(partitionResult);
+    }
+
+    std::vector<std::pair<size_t, float>> rows;
+    for (const auto& [row, score] : bestRows.sorted()) {
+        rows.emplace_back((size_t)row, score);
+    }
+    return rows;
+}
+
+// Rows of the result of findBestRows, to narrow the next stage down to
+std::vector<size_t> rowsOf(const std::vector<std::pair<size_t, float>>& scoredRows) {
+    std::vector<size_t> rows;
+    rows.reserve(scoredRows.size());
+    for (const auto& [row, score] : scoredRows) {
+        rows.push_back(row);
+    }
+    return rows;
+}
+
+// Three stage cascade: every shoe is ranked by its coarse colour signature and the best
+// nrOfColorCandidates are kept, those are narrowed to nrOfTextureCandidates by their weighted
+// RGB and LBP score, and only the survivors get the expensive HOG term added.
+std::vector<std::pair<int, float>> cascadeMostSimilarShoes(
+    const FeatureMatrix& features,
+    const FeatureQuery& query,
+    int nrOfSimilarShoes,
+    int nrOfColorCandidates,
+    int nrOfTextureCandidates,
+    SearchStatistics* statistics = nullptr
+) {
+    const FeatureLayout& layout = features.layout;
+    const float* weightedQuery = query.weightedValues.get();
+
+    std::vector<size_t> colorCandidates = rowsOf(findBestRows(features.rows(), nullptr, nrOfColorCandidates, [&](size_t row) {
+        return correlateColorSignature(features, row, query);
+    }));
+
+    // The colour and LBP segments precede the HOG segment, so their weighted score is one dot product
+    std::vector<size_t> textureCandidates = rowsOf(findBestRows(features.rows(), &colorCandidates, nrOfTextureCandidates, [&](size_t row) {
+        return dotProduct(features.row(row), weightedQuery, layout.offsets[HOGSegment]);
+    }));
+
+    // The last stage scores are the full scores, they are returned as they are
+    std::vector<std::pair<size_t, float>> hogCandidates = findBestRows(features.rows(), &textureCandidates, nrOfSimilarShoes, [&](size_t row) {
+        return scoreFeatureRow(features.row(row), query);
+    });
+
+    if (statistics != nullptr) {
+        statistics->stageSurvivors = {
+            {"indexed", features.rows()},
+            {"color", colorCandidates.size()},
+            {"texture", textureCandidates.size()},
+            {"hog", hogCandidates.size()}
+        };
+    }
+
+    std::vector<std::pair<int, float>> similarShoeImages;
+    for (const auto& [row, score] : hogCandidates) {
+        similarShoeImages.emplace_back(features.shoeImageIds[row], score);
+    }
     return similarShoeImages;
 }
 
+// Rescore approximate candidates exactly with the full RGB/LBP/HOG formula and keep the best ones
+std::vector<std::pair<int, float>> rescoreCandidates(
+    const FeatureMatrix& features,
+    const FeatureQuery& query,
+    const std::vector<size_t>& candidateRows,
+    int nrOfSimilarShoes
+) {
+    TopKShoes similarShoeImages(nrOfSimilarShoes);
+    std::unordered_set<size_t> rescoredRows;
+    for (size_t row : candidateRows) {
+        if (rescoredRows.insert(row).second) {
+            similarShoeImages.push(features.shoeImageIds[row], (float)scoreFeatureRow(features.row(row), query));
+        }
+    }
+    return similarShoeImages.sorted();
+}
+
+// Rescore the resident candidates of the compressed index from the feature matrix. The ids of the
+// candidates whose full features are not resident are added to missingShoeImageIds, they are
+// rescored with rescoreFetchedCandidates once the index lock is released.
+std::vector<std::pair<int, float>> rescoreResidentCandidates(
+    const IndexedShoeFeatures& indexedFeatures,
+    const FeatureQuery& query,
+    const std::vector<std::pair<int, float>>& candidates,
+    int nrOfSimilarShoes,
+    std::vector<int>& missingShoeImageIds
+) {
+    std::vector<size_t> residentRows;
+    std::unordered_set<int> missing;
+    for (const auto& [shoeImageId, approximateScore] : candidates) {
+        auto row = indexedFeatures.rowByShoeImageId.find(shoeImageId);
+        if (row != indexedFeatures.rowByShoeImageId.end()) {
+            residentRows.push_back(row->second);
+        } else if (missing.insert(shoeImageId).second) {
+            missingShoeImageIds.push_back(shoeImageId);
+        }
+    }
+    return rescoreCandidates(indexedFeatures.matrix, query, residentRows, nrOfSimilarShoes);
+}
+
+// Fetch the full precision features of candidates that are not resident from the database, rescore
+// them and merge them with the already rescored candidates. Call it without holding the index lock.
+std::vector<std::pair<int, float>> rescoreFetchedCandidates(
+    const std::vector<std::pair<int, float>>& rescoredCandidates,
+    const std::vector<int>& missingShoeImageIds,
+    const FeatureQuery& query,
+    const HOGProjection* hogProjection,
+    int nrOfSimilarShoes
+) {
+    TopKShoes similarShoeImages(nrOfSimilarShoes);
+    for (const auto& [shoeImageId, score] : rescoredCandidates) {
+        similarShoeImages.push(shoeImageId, score);
+    }
+    if (!missingShoeImageIds.empty()) {
+        FeatureMatrix missingFeatures = loadFeatureMatrix(missingShoeImageIds, hogProjection);
+        for (size_t row = 0; row < missingFeatures.rows(); row++) {
+            similarShoeImages.push(missingFeatures.shoeImageIds[row], (float)scoreFeatureRow(missingFeatures.row(row), query));
+        }
+    }
+    return similarShoeImages.sorted();
+}
+
+enum class SearchMode {
+    // Score every indexed shoe
+    Exact,
+    // Fetch candidates from the HNSW graph over the HOG features and rescore only those
+    HNSW,
+    // Fetch candidates from the compressed IVF-PQ index and rescore only those
+    IVFPQ,
+    // Narrow the indexed shoes down by colour signature, then RGB and LBP, then score HOG
+    Cascade
+};
+
+struct SearchOptions {
+    SearchMode mode = SearchMode::Exact;
+    // Number of candidates fetched from an approximate index before exact rescoring
+    int nrOfCandidates = 300;
+    // HNSW candidate list size, 0 uses the value the graph was built with
+    int efSearch = 0;
+    // IVF-PQ inverted lists visited per query, 0 uses the value the index was trained with
+    int nrOfProbes = 0;
+    // Cascade survivors of the colour signature stage and of the RGB and LBP stage
+    int nrOfColorCandidates = 1000;
+    int nrOfTextureCandidates = 200;
+    // Skip the HOG term of rows that can't reach the top k in exact searches, the result stays the same
+    bool boundHOG = true;
+};
+
+// Read the search options from the "mode", "candidates", "ef", "nprobe", "n1", "n2" and "bound" url parameters
+SearchOptions getSearchOptions(const crow::request& req) {
+    SearchOptions options;
+    const char* mode = req.url_params.get("mode");
+    if (mode != nullptr && std::string(mode) == "hnsw") {
+        options.mode = SearchMode::HNSW;
+    } else if (mode != nullptr && std::string(mode) == "ivfpq") {
+        options.mode = SearchMode::IVFPQ;
+    } else if (mode != nullptr && std::string(mode) == "cascade") {
+        options.mode = SearchMode::Cascade;
+    }
+    if (req.url_params.get("candidates") != nullptr) {
+        options.nrOfCandidates = std::max(1, std::atoi(req.url_params.get("candidates")));
+    }
+    if (req.url_params.get("ef") != nullptr) {
+        options.efSearch = std::max(0, std::atoi(req.url_params.get("ef")));
+    }
+    if (req.url_params.get("nprobe") != nullptr) {
+        options.nrOfProbes = std::max(0, std::atoi(req.url_params.get("nprobe")));
+    }
+    if (req.url_params.get("n1") != nullptr) {
+        options.nrOfColorCandidates = std::max(1, std::atoi(req.url_params.get("n1")));
+    }
+    if (req.url_params.get("n2") != nullptr) {
+        options.nrOfTextureCandidates = std::max(1, std::atoi(req.url_params.get("n2")));
+    }
+    if (req.url_params.get("bound") != nullptr) {
+        options.boundHOG = std::atoi(req.url_params.get("bound")) != 0;
+    }
+    return options;
+}
+
+// Same as above, but scores against the packed features of the resident feature index.
+// Approximate modes fall back to an exact scan when their index is not built. When only the IVF-PQ
+// codes are resident every mode searches them, and the candidates are re-ranked from the database.
+// The candidates surviving each stage are written to statistics when it is given.
+std::vector<std::pair<int, float>> compareShoeProperties(
+    const ShoeFeatureIndex& shoeFeatureIndex,
+    const ShoeProperties& inputShoeFeatures,
+    int nrOfSimilarShoes = 5,
+    const SearchOptions& options = SearchOptions(),
+    SearchStatistics* statistics = nullptr
+) {
+    // Filled under the index lock, the candidates that are not resident are fetched after releasing it
+    std::unique_ptr<FeatureQuery> fetchQuery;
+    std::shared_ptr<const HOGProjection> hogProjection;
+    std::vector<int> missingShoeImageIds;
+
+    std::vector<std::pair<int, float>> similarShoeImages = shoeFeatureIndex.query([&](const IndexedShoeFeatures& indexedFeatures) {
+        const FeatureMatrix& features = indexedFeatures.matrix;
+        hogProjection = indexedFeatures.hogProjection;
+        fetchQuery = std::make_unique<FeatureQuery>(features.layout, projectShoeProperties(inputShoeFeatures, hogProjection.get()));
+        const FeatureQuery& query = *fetchQuery;
+
+        if (options.mode == SearchMode::HNSW && indexedFeatures.hogGraph) {
+            const float* hogQuery = query.values.get() + features.layout.offsets[HOGSegment];
+            std::vector<size_t> candidateRows;
+            for (const auto& [row, hogSimilarity] : indexedFeatures.hogGraph->search(
+                    features, hogQuery, std::max(options.nrOfCandidates, nrOfSimilarShoes), options.efSearch)) {
+                candidateRows.push_back(row);
+            }
+            if (statistics != nullptr) {
+                statistics->stageSurvivors = {{"indexed", features.rows()}, {"hnsw", candidateRows.size()}};
+            }
+            return rescoreCandidates(features, query, candidateRows, nrOfSimilarShoes);
+        }
+
+        if ((options.mode == SearchMode::IVFPQ || indexedFeatures.codesOnly) &&
+                indexedFeatures.ivfpq && indexedFeatures.ivfpq->layout == features.layout) {
+            std::vector<std::pair<int, float>> candidates = indexedFeatures.ivfpq->search(
+                query, std::max(options.nrOfCandidates, nrOfSimilarShoes), options.nrOfProbes);
+            if (statistics != nullptr) {
+                statistics->stageSurvivors = {{"indexed", indexedFeatures.ivfpq->size()}, {"ivfpq", candidates.size()}};
+            }
+            return rescoreResidentCandidates(indexedFeatures, query, candidates, nrOfSimilarShoes, missingShoeImageIds);
+        }
+
+        if (options.mode == SearchMode::Cascade) {
+            return cascadeMostSimilarShoes(features, query, nrOfSimilarShoes,
+                std::max(options.nrOfColorCandidates, nrOfSimilarShoes),
+                std::max(options.nrOfTextureCandidates, nrOfSimilarShoes),
+                statistics);
+        }
+
+        if (options.boundHOG) {
+            return boundedMostSimilarShoes(features, query, nrOfSimilarShoes, statistics);
+        }
+
+        if (statistics != nullptr) {
+            statistics->stageSurvivors = {{"indexed", features.rows()}};
+        }
+        return findMostSimilarShoes(features, query, nrOfSimilarShoes);
+    });
+
+    if (missingShoeImageIds.empty()) {
+        return similarShoeImages;
+    }
+    // Saves and reloads wait for the index lock, so they must not wait on this fetch as well
+    return rescoreFetchedCandidates(similarShoeImages, missingShoeImageIds, *fetchQuery, hogProjection.get(), nrOfSimilarShoes);
+}
+
 #endif // !COMPARE_H
\ No newline at end of file
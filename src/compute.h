@@ -1,12 +1,124 @@
 #ifndef COMPUTE_H
 #define COMPUTE_H
 
+#include <algorithm>
+#include <cstdint>
+#include <exception>
 #include <iostream>
+#include <limits>
+#include <numeric>
+#include <string>
 #include <opencv2/opencv.hpp>
 #include <opencv2/face.hpp>
 #include <vector>
 #include "utils.h"
 
+// How the background around a segmented shoe looks
+enum class BackgroundModel {
+    // Pure white, what the segmentation service produces
+    White,
+    // Pure black
+    Black,
+    // A uniform color, estimated from the pixels on the image border
+    Border
+};
+
+struct ForegroundOptions {
+    // Uploads come with a black background and stored shoes with a white one, the border tells them apart
+    BackgroundModel backgroundModel = BackgroundModel::Border;
+    // Maximum difference per channel between a background pixel and the background color,
+    // large enough for the JPEG noise around the shoe
+    int tolerance = 24;
+    // Crop the image to the bounding box of the shoe before it is resized
+    bool cropToShoe = true;
+};
+
+// Color of the background under the given model, the per channel median of the border pixels for Border
+cv::Vec3b estimateBackgroundColor(const cv::Mat& image, BackgroundModel backgroundModel) {
+    if (backgroundModel == BackgroundModel::White) {
+        return cv::Vec3b(255, 255, 255);
+    }
+    if (backgroundModel == BackgroundModel::Black) {
+        return cv::Vec3b(0, 0, 0);
+    }
+
+    std::vector<uchar> borderValues[3];
+    auto addBorderPixel = [&](int y, int x) {
+        const cv::Vec3b& pixel = image.at<cv::Vec3b>(y, x);
+        for (int channel = 0; channel < 3; channel++) {
+            borderValues[channel].push_back(pixel[channel]);
+        }
+    };
+    for (int x = 0; x < image.cols; x++) {
+        addBorderPixel(0, x);
+        addBorderPixel(image.rows - 1, x);
+    }
+    for (int y = 1; y < image.rows - 1; y++) {
+        addBorderPixel(y, 0);
+        addBorderPixel(y, image.cols - 1);
+    }
+
+    cv::Vec3b backgroundColor;
+    for (int channel = 0; channel < 3; channel++) {
+        std::vector<uchar>& values = borderValues[channel];
+        std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+        backgroundColor[channel] = values[values.size() / 2];
+    }
+    return backgroundColor;
+}
+
+// Compute the foreground mask of an 8-bit BGR image in a single pass: 255 where the shoe is,
+// 0 where a pixel is within the tolerance of the background color in every channel
+cv::Mat computeForegroundMask(const cv::Mat& image, const ForegroundOptions& options = ForegroundOptions()) {
+    if (image.type() != CV_8UC3) {
+        throw std::runtime_error("Foreground masks need an 8-bit BGR image");
+    }
+
+    const cv::Vec3b backgroundColor = estimateBackgroundColor(image, options.backgroundModel);
+    cv::Mat foregroundMask(image.size(), CV_8UC1);
+    for (int i = 0; i < image.rows; i++) {
+        const uchar* row = image.ptr<uchar>(i);
+        uchar* maskRow = foregroundMask.ptr<uchar>(i);
+#pragma omp simd
+        for (int j = 0; j < image.cols; j++) {
+            bool isBackground =
+                std::abs(row[3 * j] - backgroundColor[0]) <= options.tolerance &&
+                std::abs(row[3 * j + 1] - backgroundColor[1]) <= options.tolerance &&
+                std::abs(row[3 * j + 2] - backgroundColor[2]) <= options.tolerance;
+            maskRow[j] = isBackground ? 0 : 255;
+        }
+    }
+    return foregroundMask;
+}
+
+// A shoe image and its foreground mask, cropped and resized to the feature resolution
+struct SegmentedShoe {
+    cv::Mat image;
+    cv::Mat foregroundMask;
+};
+
+// Foreground segmentation stage run once per uploaded image: the mask is computed on the decoded
+// image, both are cropped to the bounding box of the shoe and resized to the feature resolution.
+// An image without foreground pixels is kept whole.
+SegmentedShoe segmentShoe(const cv::Mat& image, const ForegroundOptions& options = ForegroundOptions()) {
+    cv::Mat foregroundMask = computeForegroundMask(image, options);
+
+    cv::Rect shoeBounds(0, 0, image.cols, image.rows);
+    if (options.cropToShoe) {
+        cv::Rect foregroundBounds = cv::boundingRect(foregroundMask);
+        if (foregroundBounds.area() > 0) {
+            shoeBounds = foregroundBounds;
+        }
+    }
+
+    SegmentedShoe segmentedShoe;
+    cv::Size featureSize(featureImageSize, featureImageSize);
+    cv::resize(image(shoeBounds), segmentedShoe.image, featureSize);
+    // Nearest neighbour keeps the mask binary
+    cv::resize(foregroundMask(shoeBounds), segmentedShoe.foregroundMask, featureSize, 0, 0, cv::INTER_NEAREST);
+    return segmentedShoe;
+}
+
 // Structures for computed shoe properties
 struct ShoeColor {
     float red;
@@ -14,38 +126,59 @@ struct ShoeColor {
     float blue;
 };
 
-// Method to get shoe metadata
-ShoeColor computeShoeColorRGB(cv::Mat image) {
-    ShoeColor shoeColor;
-    shoeColor.red = 0.0;
-    shoeColor.green = 0.0;
-    shoeColor.blue = 0.0;
-
-    for (int x = 0; x < image.cols; x++) {
-        for (int y = 0; y < image.rows; y++) {
-            // if pixel is black skip it as it's not part of the shoe, its just the background
-            if (image.at<cv::Vec3b>(y, x) == cv::Vec3b(0, 0, 0)) {
-                continue;
-            }
-            cv::Vec3b pixel = image.at<cv::Vec3b>(y, x);
-            shoeColor.red += pixel[2];
-            shoeColor.green += pixel[1];
-            shoeColor.blue += pixel[0];
+// Sum the blue, green and red values of one row of 8-bit BGR pixels, only over the pixels
+// that are non-zero in the mask row when one is given
+void sumRowColors(const uchar* row, const uchar* maskRow, int cols, uint64_t& blueSum, uint64_t& greenSum, uint64_t& redSum) {
+    uint32_t blue = 0, green = 0, red = 0;
+    if (maskRow == nullptr) {
+#pragma omp simd reduction(+ : blue, green, red)
+        for (int j = 0; j < cols; j++) {
+            blue += row[3 * j];
+            green += row[3 * j + 1];
+            red += row[3 * j + 2];
+        }
+    } else {
+#pragma omp simd reduction(+ : blue, green, red)
+        for (int j = 0; j < cols; j++) {
+            uint32_t isForeground = maskRow[j] != 0;
+            blue += isForeground * row[3 * j];
+            green += isForeground * row[3 * j + 1];
+            red += isForeground * row[3 * j + 2];
         }
     }
+    blueSum += blue;
+    greenSum += green;
+    redSum += red;
+}
+
+// Method to get shoe metadata: the share of red, green and blue in the summed color of the shoe.
+// Without a foreground mask black pixels are the background, they add nothing to the sums anyway,
+// so every pixel is summed. With a mask only the foreground pixels are summed.
+ShoeColor computeShoeColorRGB(cv::Mat image, const cv::Mat& foregroundMask = cv::Mat()) {
+    if (image.type() != CV_8UC3) {
+        throw std::runtime_error("Shoe colors need an 8-bit BGR image");
+    }
+    if (!foregroundMask.empty() && (foregroundMask.type() != CV_8UC1 || foregroundMask.size() != image.size())) {
+        throw std::runtime_error("Foreground mask has to be an 8-bit mask of the image size");
+    }
+
+    uint64_t blueSum = 0, greenSum = 0, redSum = 0;
+    for (int i = 0; i < image.rows; i++) {
+        const uchar* maskRow = foregroundMask.empty() ? nullptr : foregroundMask.ptr<uchar>(i);
+        sumRowColors(image.ptr<uchar>(i), maskRow, image.cols, blueSum, greenSum, redSum);
+    }
 
     // Compute percentages of color
-    double totalShoeColorValues = shoeColor.red + shoeColor.green + shoeColor.blue;
+    double totalShoeColorValues = (double)(blueSum + greenSum + redSum);
 
-    if (totalShoeColorValues < 0) {
+    if (totalShoeColorValues <= 0) {
         throw std::runtime_error("No shoe colors were detected.");
     }
 
-    shoeColor.red = (shoeColor.red / totalShoeColorValues) * 100;
-    shoeColor.green = (shoeColor.green / totalShoeColorValues) * 100;
-    shoeColor.blue = (shoeColor.blue / totalShoeColorValues) * 100;
-
-    std::cout << "Shoe color: red " << shoeColor.red << "%, green " << shoeColor.green << "%, blue" << shoeColor.blue << "%." << std::endl;
+    ShoeColor shoeColor;
+    shoeColor.red = (float)(redSum / totalShoeColorValues * 100);
+    shoeColor.green = (float)(greenSum / totalShoeColorValues * 100);
+    shoeColor.blue = (float)(blueSum / totalShoeColorValues * 100);
 
     return shoeColor;
 }
@@ -60,187 +193,586 @@ struct DominantColor {
     }
 };
 
-std::vector<DominantColor> computeDominantColors(cv::Mat image, int k = 4) {
-    // std::vector<cv::Vec3b> dominantColors(k);
-    cv::Mat resizedImage;
-    image.convertTo(resizedImage, CV_32F);
-    resizedImage = resizedImage.reshape(1, resizedImage.total());
+// Bits kept per channel when binning pixels for the dominant colour clustering
+constexpr int dominantColorBinBits = 4;
+
+// Compute the k dominant colors of the shoe and the percentage of its pixels each one covers.
+// The foreground pixels (the non-zero pixels of the foreground mask, or without one of the mask
+// computed with the default ForegroundOptions, against the background estimated from the image
+// border) are first binned into a coarse 16x16x16 color histogram, then the occupied bins are
+// clustered with k-means weighted by their pixel counts. Clustering a few hundred bins instead of every pixel makes this cheap
+// enough for a request thread, and the fixed seed makes the result reproducible.
+std::vector<DominantColor> computeDominantColors(cv::Mat image, int k = 4, const cv::Mat& foregroundMask = cv::Mat()) {
+    if (image.type() != CV_8UC3) {
+        throw std::runtime_error("Dominant colors need an 8-bit BGR image");
+    }
+    cv::Mat mask = foregroundMask.empty() ? computeForegroundMask(image) : foregroundMask;
+
+    // Pixel count and color sums per bin, so every bin is represented by the mean of its pixels
+    constexpr int binsPerChannel = 1 << dominantColorBinBits;
+    constexpr int shift = 8 - dominantColorBinBits;
+    std::vector<int> binCounts(binsPerChannel * binsPerChannel * binsPerChannel, 0);
+    std::vector<cv::Vec3d> binSums(binCounts.size(), cv::Vec3d(0, 0, 0));
+    for (int i = 0; i < image.rows; i++) {
+        const cv::Vec3b* row = image.ptr<cv::Vec3b>(i);
+        const uchar* maskRow = mask.ptr<uchar>(i);
+        for (int j = 0; j < image.cols; j++) {
+            const cv::Vec3b& pixel = row[j];
+            if (maskRow[j] == 0) {
+                continue;
+            }
+            int bin = ((pixel[0] >> shift) * binsPerChannel + (pixel[1] >> shift)) * binsPerChannel + (pixel[2] >> shift);
+            binCounts[bin]++;
+            binSums[bin] += cv::Vec3d(pixel[0], pixel[1], pixel[2]);
+        }
+    }
+
+    std::vector<cv::Vec3f> points;
+    std::vector<double> weights;
+    double totalPixels = 0.0;
+    for (size_t bin = 0; bin < binCounts.size(); bin++) {
+        if (binCounts[bin] > 0) {
+            points.push_back(cv::Vec3f(binSums[bin] * (1.0 / binCounts[bin])));
+            weights.push_back(binCounts[bin]);
+            totalPixels += binCounts[bin];
+        }
+    }
+    if (points.empty()) {
+        throw std::runtime_error("No shoe colors were detected.");
+    }
+    k = std::min(k, (int)points.size());
+
+    auto squaredDistance = [](const cv::Vec3f& a, const cv::Vec3f& b) {
+        cv::Vec3f difference = a - b;
+        return difference.dot(difference);
+    };
+
+    // Weighted k-means++ seeding with a fixed seed
+    cv::RNG random(42);
+    std::vector<cv::Vec3f> centers;
+    std::vector<double> closestDistances(points.size(), std::numeric_limits<double>::max());
+    std::vector<double> seedWeights = weights;
+    for (int cluster = 0; cluster < k; cluster++) {
+        double total = std::accumulate(seedWeights.begin(), seedWeights.end(), 0.0);
+        double target = random.uniform(0.0, total);
+        size_t chosen = 0;
+        for (double cumulative = seedWeights[0]; cumulative < target && chosen + 1 < points.size(); cumulative += seedWeights[++chosen]) {}
+        centers.push_back(points[chosen]);
+
+        for (size_t i = 0; i < points.size(); i++) {
+            closestDistances[i] = std::min(closestDistances[i], (double)squaredDistance(points[i], centers.back()));
+            seedWeights[i] = weights[i] * closestDistances[i];
+        }
+    }
+
+    // Weighted Lloyd iterations until the assignment is stable
+    std::vector<int> labels(points.size(), -1);
+    std::vector<double> clusterWeights(k);
+    for (int iteration = 0; iteration < 20; iteration++) {
+        bool isChanged = false;
+        for (size_t i = 0; i < points.size(); i++) {
+            int closest = 0;
+            for (int cluster = 1; cluster < k; cluster++) {
+                if (squaredDistance(points[i], centers[cluster]) < squaredDistance(points[i], centers[closest])) {
+                    closest = cluster;
+                }
+            }
+            isChanged |= labels[i] != closest;
+            labels[i] = closest;
+        }
 
-    cv::Mat labels, centers;
-    cv::kmeans(resizedImage, k, labels, cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 10, 1.0), 3, cv::KMEANS_PP_CENTERS, centers);
+        std::vector<cv::Vec3d> clusterSums(k, cv::Vec3d(0, 0, 0));
+        std::fill(clusterWeights.begin(), clusterWeights.end(), 0.0);
+        for (size_t i = 0; i < points.size(); i++) {
+            clusterSums[labels[i]] += cv::Vec3d(points[i]) * weights[i];
+            clusterWeights[labels[i]] += weights[i];
+        }
+        for (int cluster = 0; cluster < k; cluster++) {
+            if (clusterWeights[cluster] > 0) {
+                centers[cluster] = cv::Vec3f(clusterSums[cluster] * (1.0 / clusterWeights[cluster]));
+            }
+        }
 
-    int totalPixels = labels.rows;
-    std::vector<int> totalPixelsPerCentroid(k, 0);
-    for (int i = 0; i < labels.rows; ++i) {
-        totalPixelsPerCentroid[labels.at<int>(i)]++;
+        if (!isChanged) {
+            break;
+        }
     }
 
     std::vector<DominantColor> dominantColors(k);
     for (int i = 0; i < k; ++i) {
-        dominantColors[i].color = centers.at<cv::Vec3f>(i);
-        std::cout << "totalPixelsPerCentroid[" << i << "]: " << totalPixelsPerCentroid[i] << " total pixels " << totalPixels << std::endl;
-        dominantColors[i].percentage = (1.0f * totalPixelsPerCentroid[i] / totalPixels) * 100;
-        std::cout << "Color " << i << ": " << dominantColors[i].color << " percentage: " << dominantColors[i].percentage << std::endl;
+        dominantColors[i].color = centers[i];
+        dominantColors[i].percentage = (float)(clusterWeights[i] / totalPixels * 100);
     }
 
-    // display the colors
-    cv::Mat colorSwatch(100, 100 * k, CV_8UC3);
-    for (int i = 0; i < k; ++i) {
-        colorSwatch.colRange(i * 100, (i + 1) * 100) = dominantColors[i].color;
-        std::cout << "Color " << i << ": " << dominantColors[i].color << " percentage: " << dominantColors[i].percentage << std::endl;
-    }
+    return dominantColors;
+}
 
-    cv::imshow("Dominant Colors", colorSwatch);
-    cv::waitKey(0);
+// Count the blue, green and red values of an 8-bit BGR image into three 256-bin histograms
+// in a single pass over the interleaved pixels. Background pixels are skipped: pixels that are
+// zero in the foreground mask when one is given, pure white pixels otherwise. Pixels alternate
+// between two sets of histograms so consecutive equal values don't wait on each other's increment.
+void countRGBValues(
+    const uchar* pixels, size_t step, int rows, int cols,
+    const uchar* mask, size_t maskStep,
+    uint32_t* blueCounts, uint32_t* greenCounts, uint32_t* redCounts
+) {
+    uint32_t subHistograms[2][3][256] = {};
+
+    for (int i = 0; i < rows; i++) {
+        const uchar* row = pixels + i * step;
+        const uchar* maskRow = mask != nullptr ? mask + i * maskStep : nullptr;
+        for (int j = 0; j < cols; j++) {
+            const uchar blue = row[3 * j];
+            const uchar green = row[3 * j + 1];
+            const uchar red = row[3 * j + 2];
+            if (maskRow != nullptr ? maskRow[j] == 0 : (blue & green & red) == 255) {
+                continue;
+            }
 
-    return dominantColors;
+            uint32_t (&laneHistograms)[3][256] = subHistograms[j & 1];
+            laneHistograms[0][blue]++;
+            laneHistograms[1][green]++;
+            laneHistograms[2][red]++;
+        }
+    }
+
+    for (int bin = 0; bin < 256; bin++) {
+        blueCounts[bin] = subHistograms[0][0][bin] + subHistograms[1][0][bin];
+        greenCounts[bin] = subHistograms[0][1][bin] + subHistograms[1][1][bin];
+        redCounts[bin] = subHistograms[0][2][bin] + subHistograms[1][2][bin];
+    }
 }
 
-std::vector<cv::Mat> computeRGBHistograms(cv::Mat image) {
-    std::vector<cv::Mat> histograms;
-    std::vector<cv::Mat> bgrChannels;
-    cv::split(image, bgrChannels);
-
-    // Mask to ignore white background - adapt to background color
-    cv::Mat mask;
-    cv::inRange(image, cv::Scalar(255, 255, 255), cv::Scalar(255, 255, 255), mask);
-    // Invert the mask so only the shoe is highlighted, not the background
-    cv::bitwise_not(mask, mask);
-    // cv::imshow("Mask", mask);
-    // cv::waitKey(0);
+// Compute the blue, green and red histograms of the shoe, ignoring the white background or
+// the pixels outside of the given foreground mask.
+// Every histogram is a bins x 1 CV_32F Mat normalized to [0, 400], the format stored in the
+// red_histogram, green_histogram and blue_histogram columns. Fewer bins than 256 merge
+// neighbouring intensities, bins has to divide 256.
+std::vector<cv::Mat> computeRGBHistograms(cv::Mat image, const cv::Mat& foregroundMask = cv::Mat(), int bins = 256) {
+    if (image.type() != CV_8UC3) {
+        throw std::runtime_error("RGB histograms need an 8-bit BGR image");
+    }
+    if (bins <= 0 || 256 % bins != 0) {
+        throw std::runtime_error("RGB histogram bins have to divide 256");
+    }
+    if (!foregroundMask.empty() && (foregroundMask.type() != CV_8UC1 || foregroundMask.size() != image.size())) {
+        throw std::runtime_error("Foreground mask has to be an 8-bit mask of the image size");
+    }
+
+    uint32_t counts[3][256];
+    countRGBValues(
+        image.ptr<uchar>(), image.step, image.rows, image.cols,
+        foregroundMask.empty() ? nullptr : foregroundMask.ptr<uchar>(), foregroundMask.step,
+        counts[0], counts[1], counts[2]);
 
+    std::vector<cv::Mat> histograms;
     for (int i = 0; i < 3; i++) {
-        cv::Mat hist;
-        int histSize = 256;
-        float range[] = {0, 256};
-        const float* histRange = {range};
-
-        cv::calcHist(&bgrChannels[i], 1, 0, mask, hist, 1, &histSize, &histRange);
-
-        // display histogram for testing purposes
-        int hist_w = 512; int hist_h = 400;
-        int bin_w = cvRound((double)hist_w/histSize);
-        cv::Mat histImage(hist_h, hist_w, CV_8UC3, cv::Scalar(0, 0, 0));
-        // // Normalize the histogram
-        cv::normalize(hist, hist, 0, histImage.rows, cv::NORM_MINMAX, CV_32F);
-        std::cout << "Histogram size: " << hist.size() << std::endl;
-        std::cout << "Mat type: " << hist.type() << std::endl;
-        // // Draw the histogram
-        // for (int j = 0; j < histSize; j++) {
-        //     cv::line(histImage,
-        //         cv::Point(j*bin_w, hist_h - cvRound(hist.at<float>(j))),
-        //         cv::Point((j+1)*bin_w, hist_h - cvRound(hist.at<float>(j+1))),
-        //         cv::Scalar(255, 0, 0), 2, 8, 0);
-        // }
-        // // Display the histogram image
-        // cv::imshow("Histogram " + std::to_string(i), histImage);
-        // cv::waitKey(0);
+        cv::Mat hist = cv::Mat::zeros(bins, 1, CV_32F);
+        for (int value = 0; value < 256; value++) {
+            hist.at<float>(value * bins / 256) += (float)counts[i][value];
+        }
 
+        // Normalize the histogram to the height of the histogram plot it was designed for
+        cv::normalize(hist, hist, 0, 400, cv::NORM_MINMAX, CV_32F);
         histograms.push_back(hist);
     }
 
     return histograms;
 }
 
-// Function to compute the LBP histogram
-cv::Mat computeLBPHistogram(cv::Mat image, int numPatterns = 256) {
-    cv::Mat gray;
-    if (image.channels() == 3) {
-        cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
-    } else {
-        gray = image.clone();
+// Interleaved histograms the LBP codes are counted into
+constexpr int lbpSubHistograms = 4;
+
+// Count the 8-neighbour LBP codes of a grayscale image into 256 bins in a single pass.
+// Codes of a whole row are computed at once from the three source rows around it, so the
+// comparisons vectorize, and are counted into lbpSubHistograms interleaved histograms so that
+// consecutive pixels with the same code don't wait on each other's increment.
+// Border pixels have no full neighbourhood and are counted as code 0.
+void countLBPCodes(const uchar* pixels, size_t step, int rows, int cols, uint32_t* counts) {
+    uint32_t subHistograms[lbpSubHistograms][256] = {};
+    std::vector<uchar> codes(std::max(cols - 2, 0));
+
+    for (int i = 1; i < rows - 1; i++) {
+        const uchar* above = pixels + (i - 1) * step;
+        const uchar* row = pixels + i * step;
+        const uchar* below = pixels + (i + 1) * step;
+        uchar* rowCodes = codes.data();
+
+#pragma omp simd
+        for (int j = 1; j < cols - 1; j++) {
+            const uchar center = row[j];
+            rowCodes[j - 1] = (uchar)(
+                ((above[j - 1] > center) << 7) |
+                ((above[j]     > center) << 6) |
+                ((above[j + 1] > center) << 5) |
+                ((row[j + 1]   > center) << 4) |
+                ((below[j + 1] > center) << 3) |
+                ((below[j]     > center) << 2) |
+                ((below[j - 1] > center) << 1) |
+                ((row[j - 1]   > center) << 0));
+        }
+
+        int j = 0;
+        for (; j + lbpSubHistograms <= cols - 2; j += lbpSubHistograms) {
+            for (int lane = 0; lane < lbpSubHistograms; lane++) {
+                subHistograms[lane][rowCodes[j + lane]]++;
+            }
+        }
+        for (; j < cols - 2; j++) {
+            subHistograms[0][rowCodes[j]]++;
+        }
+    }
+
+    for (int bin = 0; bin < 256; bin++) {
+        counts[bin] = 0;
+        for (int lane = 0; lane < lbpSubHistograms; lane++) {
+            counts[bin] += subHistograms[lane][bin];
+        }
+    }
+    uint32_t interiorPixels = (uint32_t)(std::max(rows - 2, 0) * std::max(cols - 2, 0));
+    counts[0] += (uint32_t)(rows * cols) - interiorPixels;
+}
+
+// Compute the LBP histogram of an 8-bit grayscale image
+cv::Mat computeGrayLBPHistogram(const cv::Mat& gray, int numPatterns = 256) {
+    uint32_t counts[256];
+    countLBPCodes(gray.ptr<uchar>(), gray.step, gray.rows, gray.cols, counts);
+
+    // Codes outside [0, numPatterns) are not counted, like a calcHist over that range
+    cv::Mat hist = cv::Mat::zeros(numPatterns, 1, CV_32F);
+    for (int bin = 0; bin < std::min(numPatterns, 256); bin++) {
+        hist.at<float>(bin) = (float)counts[bin];
     }
-    std::cout << "check if image was not modified accidentally" << std::endl;
-    std::cout << "image channels should be 3: " << image.channels() << std::endl;
 
-    cv::Mat lbpImage = cv::Mat::zeros(gray.size(), CV_8UC1);
+    // Normalize the histogram
+    cv::normalize(hist, hist, 0, 1, cv::NORM_MINMAX, -1, cv::Mat());
+
+    return hist;
+}
 
-    for (int i = 1; i < gray.rows - 1; i++) {
-        for (int j = 1; j < gray.cols - 1; j++) {
-            uchar center = gray.at<uchar>(i, j);
-            unsigned char code = 0;
+// How the 256 LBP codes are grouped into histogram bins
+enum class LBPMapping {
+    // Every code has its own bin, 256 bins
+    None,
+    // Uniform patterns, with at most two 0/1 transitions around the circle, keep their own bin,
+    // all other codes share the last one, 59 bins
+    Uniform,
+    // Uniform patterns are binned by their number of set bits, which makes them invariant to
+    // rotation, all other codes share the last bin, 10 bins
+    RotationInvariantUniform
+};
 
-            code |= (gray.at<uchar>(i-1, j-1) > center) << 7;
-            code |= (gray.at<uchar>(i-1, j)   > center) << 6;
-            code |= (gray.at<uchar>(i-1, j+1) > center) << 5;
-            code |= (gray.at<uchar>(i,   j+1) > center) << 4;
-            code |= (gray.at<uchar>(i+1, j+1) > center) << 3;
-            code |= (gray.at<uchar>(i+1, j)   > center) << 2;
-            code |= (gray.at<uchar>(i+1, j-1) > center) << 1;
-            code |= (gray.at<uchar>(i,   j-1) > center) << 0;
+int getNrOfLBPBins(LBPMapping mapping) {
+    switch (mapping) {
+        case LBPMapping::Uniform: return 59;
+        case LBPMapping::RotationInvariantUniform: return 10;
+        default: return 256;
+    }
+}
 
-            lbpImage.at<uchar>(i, j) = code;
+// Bin of every LBP code under a mapping
+std::vector<uchar> getLBPBinTable(LBPMapping mapping) {
+    std::vector<uchar> binTable(256);
+    int nextUniformBin = 0;
+    for (int code = 0; code < 256; code++) {
+        int rotatedCode = ((code << 1) | (code >> 7)) & 0xFF;
+        int transitions = __builtin_popcount(code ^ rotatedCode);
+        bool isUniform = transitions <= 2;
+
+        if (mapping == LBPMapping::Uniform) {
+            binTable[code] = isUniform ? nextUniformBin++ : 58;
+        } else if (mapping == LBPMapping::RotationInvariantUniform) {
+            binTable[code] = isUniform ? __builtin_popcount(code) : 9;
+        } else {
+            binTable[code] = code;
         }
     }
+    return binTable;
+}
+
+// Compute the LBP histogram of an 8-bit grayscale image with its codes grouped by a mapping
+cv::Mat computeGrayLBPHistogram(const cv::Mat& gray, LBPMapping mapping) {
+    if (mapping == LBPMapping::None) {
+        return computeGrayLBPHistogram(gray);
+    }
+
+    static const std::vector<uchar> uniformBinTable = getLBPBinTable(LBPMapping::Uniform);
+    static const std::vector<uchar> rotationInvariantBinTable = getLBPBinTable(LBPMapping::RotationInvariantUniform);
+    const std::vector<uchar>& binTable = mapping == LBPMapping::Uniform ? uniformBinTable : rotationInvariantBinTable;
 
-    // Set the number of bins to the number of patterns (usually 256)
-    int histSize = numPatterns;
-    float range[] = { 0, (float)numPatterns };
-    const float* histRange = { range };
+    uint32_t counts[256];
+    countLBPCodes(gray.ptr<uchar>(), gray.step, gray.rows, gray.cols, counts);
 
-    cv::Mat hist;
-    cv::calcHist(&lbpImage, 1, 0, cv::Mat(), hist, 1, &histSize, &histRange, true, false);
+    cv::Mat hist = cv::Mat::zeros(getNrOfLBPBins(mapping), 1, CV_32F);
+    for (int code = 0; code < 256; code++) {
+        hist.at<float>(binTable[code]) += (float)counts[code];
+    }
 
     // Normalize the histogram
     cv::normalize(hist, hist, 0, 1, cv::NORM_MINMAX, -1, cv::Mat());
-    std::cout << "LBP histogram size: " << hist.size() << std::endl;
-    std::cout << "Mat type: " << hist.type() << std::endl;
-
-    // // Test display the lbpimage
-    // cv::imshow("LBP Image", lbpImage);
-    // cv::waitKey(0);
 
     return hist;
 }
 
-cv::Mat computeHOGFeatures(cv::Mat image) {
-    cv::Mat grayImage;
+// Function to compute the LBP histogram
+cv::Mat computeLBPHistogram(cv::Mat image, int numPatterns = 256) {
+    cv::Mat gray;
     if (image.channels() == 3) {
-        cv::cvtColor(image, grayImage, cv::COLOR_BGR2GRAY);
+        cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
     } else {
-        grayImage = image.clone();
+        gray = image;
     }
 
-    // Set parameters for HOG descriptors
-    cv::HOGDescriptor hog;
-    hog.winSize = cv::Size(64, 128);  // Use a fixed window size
-    hog.blockSize = cv::Size(16, 16);
-    hog.blockStride = cv::Size(8, 8);
-    hog.cellSize = cv::Size(8, 8);
-    hog.nbins = 9;
+    return computeGrayLBPHistogram(gray, numPatterns);
+}
 
-    // Resize the image to match the HOG window size
-    cv::resize(grayImage, grayImage, hog.winSize);
+// HOG descriptor configured for the 64x128 window, built once per worker thread
+// because cv::HOGDescriptor::compute is not safe to call concurrently on one instance
+cv::HOGDescriptor& getHOGDescriptor() {
+    thread_local cv::HOGDescriptor hog = []() {
+        // Set parameters for HOG descriptors, the remaining ones keep the defaults
+        cv::HOGDescriptor descriptor;
+        descriptor.winSize = cv::Size(64, 128);  // Use a fixed window size
+        descriptor.blockSize = cv::Size(16, 16);
+        descriptor.blockStride = cv::Size(8, 8);
+        descriptor.cellSize = cv::Size(8, 8);
+        descriptor.nbins = 9;
+        return descriptor;
+    }();
+    return hog;
+}
 
+// Compute the HOG features of a grayscale image that already has the HOG window size
+cv::Mat computeWindowHOGFeatures(const cv::Mat& window) {
     std::vector<float> descriptors;
-    hog.compute(grayImage, descriptors);
+    getHOGDescriptor().compute(window, descriptors);
 
     // Convert descriptors to Mat and normalize
     cv::Mat hogFeatures(descriptors, true);
     hogFeatures = hogFeatures.reshape(1, 1);  // Make it a single row matrix
     cv::normalize(hogFeatures, hogFeatures, 0, 1, cv::NORM_MINMAX);
 
-    std::cout << "HOG features size: " << hogFeatures.size() << std::endl;
-    std::cout << "Mat type: " << hogFeatures.type() << std::endl;
-
     return hogFeatures;
 }
 
+cv::Mat computeHOGFeatures(cv::Mat image) {
+    cv::Mat grayImage;
+    if (image.channels() == 3) {
+        cv::cvtColor(image, grayImage, cv::COLOR_BGR2GRAY);
+    } else {
+        grayImage = image.clone();
+    }
+
+    // Resize the image to match the HOG window size
+    cv::resize(grayImage, grayImage, getHOGDescriptor().winSize);
+
+    return computeWindowHOGFeatures(grayImage);
+}
+
 struct ShoeProperties {
     std::vector<cv::Mat> rgbHistograms;
     cv::Mat lbpHistogram;
     cv::Mat hogFeatures;
 };
 
+// Descriptor profile: which variant of the RGB and LBP descriptors is extracted. The name is the
+// version tag stored with the features, so features of different profiles can coexist in the
+// database and are never compared with each other.
+struct DescriptorProfile {
+    std::string name;
+    int rgbBins;
+    LBPMapping lbpMapping;
+
+    int lbpBins() const { return getNrOfLBPBins(lbpMapping); }
+};
+
+// Profile of the features stored before profiles existed, 256 bins per color channel and for LBP,
+// extracted from the whole image. They are kept apart from the features of the cropped shoes
+// until /recalculate-histograms replaced them.
+const std::string legacyDescriptorProfileName = "full-v1";
+// Same bins as the legacy profile, extracted from the shoe cropped by the segmentation stage
+const std::string defaultDescriptorProfileName = "full-v2";
+
+const std::vector<DescriptorProfile>& getDescriptorProfiles() {
+    static const std::vector<DescriptorProfile> descriptorProfiles = {
+        {defaultDescriptorProfileName, 256, LBPMapping::None},
+        {"rgb64-lbpu2-v2", 64, LBPMapping::Uniform},
+        {"rgb32-lbpu2-v2", 32, LBPMapping::Uniform},
+        {"rgb32-lbpriu2-v2", 32, LBPMapping::RotationInvariantUniform}
+    };
+    return descriptorProfiles;
+}
+
+const DescriptorProfile& getDescriptorProfile(const std::string& name = defaultDescriptorProfileName) {
+    for (const DescriptorProfile& descriptorProfile : getDescriptorProfiles()) {
+        if (descriptorProfile.name == name) {
+            return descriptorProfile;
+        }
+    }
+    throw std::runtime_error("Unknown descriptor profile " + name);
+}
+
+// Feature extraction for one preprocessed shoe image. The intermediates the extractors share,
+// the grayscale image, the foreground mask and the HOG sized grayscale window, are computed
+// once on first use and fed to every extractor that needs them.
+struct FeatureExtractionPipeline {
+    explicit FeatureExtractionPipeline(const cv::Mat& image, const cv::Mat& foregroundMask = cv::Mat())
+        : image(image), foregroundMask(foregroundMask) {}
+
+    // Pipeline over the output of the foreground segmentation stage, which reuses its mask
+    explicit FeatureExtractionPipeline(const SegmentedShoe& segmentedShoe)
+        : FeatureExtractionPipeline(segmentedShoe.image, segmentedShoe.foregroundMask) {}
+
+    const cv::Mat& getImage() const { return image; }
+
+    const cv::Mat& getGray() {
+        if (gray.empty()) {
+            if (image.channels() == 3) {
+                cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+            } else {
+                gray = image;
+            }
+        }
+        return gray;
+    }
+
+    // Non-zero where the shoe is. Without a mask from the segmentation stage the mask is computed
+    // with the default ForegroundOptions, against the background estimated from the image border.
+    const cv::Mat& getForegroundMask() {
+        if (foregroundMask.empty()) {
+            foregroundMask = computeForegroundMask(image);
+        }
+        return foregroundMask;
+    }
+
+    const cv::Mat& getHOGWindow() {
+        if (hogWindow.empty()) {
+            cv::resize(getGray(), hogWindow, getHOGDescriptor().winSize);
+        }
+        return hogWindow;
+    }
+
+    std::vector<cv::Mat> computeRGBHistograms(int bins = 256) {
+        return ::computeRGBHistograms(image, getForegroundMask(), bins);
+    }
+
+    cv::Mat computeLBPHistogram(LBPMapping mapping = LBPMapping::None) {
+        return computeGrayLBPHistogram(getGray(), mapping);
+    }
+
+    cv::Mat computeHOGFeatures() {
+        return computeWindowHOGFeatures(getHOGWindow());
+    }
+
+    ShoeColor computeShoeColorRGB() {
+        return ::computeShoeColorRGB(image, getForegroundMask());
+    }
+
+    std::vector<DominantColor> computeDominantColors(int k = 4) {
+        return ::computeDominantColors(image, k, getForegroundMask());
+    }
+
+    ShoeProperties computeShoeFeatures(const DescriptorProfile& profile = getDescriptorProfile()) {
+        ShoeProperties shoeFeatures;
+        shoeFeatures.rgbHistograms = computeRGBHistograms(profile.rgbBins);
+        shoeFeatures.lbpHistogram = computeLBPHistogram(profile.lbpMapping);
+        shoeFeatures.hogFeatures = computeHOGFeatures();
+
+        return shoeFeatures;
+    }
+
+private:
+    cv::Mat image;
+    cv::Mat gray;
+    cv::Mat foregroundMask;
+    cv::Mat hogWindow;
+};
+
 ShoeProperties computeShoeFeatures(cv::Mat image) {
-    ShoeProperties shoeFeatures;
-    shoeFeatures.rgbHistograms = computeRGBHistograms(image);
-    shoeFeatures.lbpHistogram = computeLBPHistogram(image);
-    shoeFeatures.hogFeatures = computeHOGFeatures(image);
+    FeatureExtractionPipeline pipeline(image);
+    return pipeline.computeShoeFeatures();
+}
+
+// Batch extraction runs on cv::parallel_for_, the pool OpenCV uses for its own internal threading.
+// OpenCV runs parallel regions nested inside a task serially, and a batch started while another
+// request holds the pool runs on its calling thread, so the batches never oversubscribe the cores.
+// An exception of one task is rethrown once all tasks are done.
+template <typename RunTask>
+void runBatchTasks(int nrOfTasks, RunTask runTask) {
+    std::vector<std::exception_ptr> taskExceptions(nrOfTasks);
+    cv::parallel_for_(cv::Range(0, nrOfTasks), [&](const cv::Range& tasks) {
+        for (int task = tasks.start; task < tasks.end; task++) {
+            try {
+                runTask(task);
+            } catch (...) {
+                taskExceptions[task] = std::current_exception();
+            }
+        }
+    }, nrOfTasks);
 
+    for (const std::exception_ptr& taskException : taskExceptions) {
+        if (taskException) {
+            std::rethrow_exception(taskException);
+        }
+    }
+}
+
+// Segment several images at once, one task per image, in the order of the images
+std::vector<SegmentedShoe> segmentShoes(const std::vector<cv::Mat>& images, const ForegroundOptions& options = ForegroundOptions()) {
+    std::vector<SegmentedShoe> segmentedShoes(images.size());
+    runBatchTasks((int)images.size(), [&](int image) {
+        segmentedShoes[image] = segmentShoe(images[image], options);
+    });
+    return segmentedShoes;
+}
+
+// Feature types that are extracted by separate tasks of a batch
+enum ShoeFeatureType {
+    RGBHistogramFeature,
+    LBPHistogramFeature,
+    HOGFeature,
+    NrOfShoeFeatureTypes
+};
+
+// Extract the features of several images at once, one task per image and feature type.
+// The results are in the order of the pipelines.
+std::vector<ShoeProperties> computeShoeFeatures(
+    std::vector<FeatureExtractionPipeline>& pipelines,
+    const DescriptorProfile& profile = getDescriptorProfile()
+) {
+    int nrOfImages = (int)pipelines.size();
+
+    // Build the intermediates shared by the feature types of an image first,
+    // so the tasks of the same image only read them afterwards
+    runBatchTasks(nrOfImages, [&](int image) {
+        pipelines[image].getForegroundMask();
+        pipelines[image].getHOGWindow();
+    });
+
+    std::vector<ShoeProperties> shoeFeatures(nrOfImages);
+    runBatchTasks(nrOfImages * NrOfShoeFeatureTypes, [&](int task) {
+        FeatureExtractionPipeline& pipeline = pipelines[task / NrOfShoeFeatureTypes];
+        ShoeProperties& features = shoeFeatures[task / NrOfShoeFeatureTypes];
+        switch (task % NrOfShoeFeatureTypes) {
+            case RGBHistogramFeature:
+                features.rgbHistograms = pipeline.computeRGBHistograms(profile.rgbBins);
+                break;
+            case LBPHistogramFeature:
+                features.lbpHistogram = pipeline.computeLBPHistogram(profile.lbpMapping);
+                break;
+            case HOGFeature:
+                features.hogFeatures = pipeline.computeHOGFeatures();
+                break;
+        }
+    });
     return shoeFeatures;
 }
 
+std::vector<ShoeProperties> computeShoeFeatures(const std::vector<SegmentedShoe>& segmentedShoes, const DescriptorProfile& profile = getDescriptorProfile()) {
+    std::vector<FeatureExtractionPipeline> pipelines(segmentedShoes.begin(), segmentedShoes.end());
+    return computeShoeFeatures(pipelines, profile);
+}
+
 double computeDistance(const cv::Mat& mat1, const cv::Mat& mat2) {
     return cv::norm(mat1, mat2, cv::NORM_L2);
 }
@@ -0,0 +1,233 @@
+#ifndef CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <pqxx/pqxx>
+
+// Connection string of the shoes database, overridden with the SHOES_DATABASE_URL environment variable
+std::string getConnectionString() {
+    const char* connectionString = std::getenv("SHOES_DATABASE_URL");
+    //Update with winhost ip
+    return connectionString != nullptr ? connectionString : "host=172.24.96.1 port=5432 dbname=shoes user=postgres password=root";
+}
+
+struct ConnectionPoolOptions {
+    // Upper bound of open connections, every request thread checks one out at a time
+    size_t maxConnections = 8;
+    // How long a checkout waits for a connection to be returned before it fails
+    std::chrono::milliseconds checkoutTimeout{5000};
+    // Connecting is retried with an exponential backoff starting at initialBackoff
+    int maxConnectAttempts = 5;
+    std::chrono::milliseconds initialBackoff{100};
+    std::chrono::milliseconds maxBackoff{2000};
+    // Idle connections older than this are pinged before they are handed out
+    std::chrono::seconds healthCheckInterval{30};
+};
+
+// Read the pool size from the SHOES_DATABASE_POOL_SIZE environment variable, by default one connection per core
+ConnectionPoolOptions getConnectionPoolOptions() {
+    ConnectionPoolOptions options;
+    options.maxConnections = std::max(2u, std::thread::hardware_concurrency());
+    const char* poolSize = std::getenv("SHOES_DATABASE_POOL_SIZE");
+    if (poolSize != nullptr && std::atoi(poolSize) > 0) {
+        options.maxConnections = std::atoi(poolSize);
+    }
+    return options;
+}
+
+// Named statement that is prepared once per connection, the first time it is used on it
+struct PreparedStatement {
+    std::string name;
+    std::string definition;
+};
+
+// Bounded pool of PostgreSQL connections shared by the request threads.
+// A pqxx::connection must not be used by two threads at once, so every database function checks
+// a connection out for the duration of its transaction and the checkout returns it when it goes
+// out of scope. Connections are opened lazily, checked before reuse and reopened when they broke.
+class ConnectionPool {
+    struct Connection {
+        std::unique_ptr<pqxx::connection> connection;
+        // Names of the statements prepared on the connection
+        std::unordered_set<std::string> preparedStatements;
+    };
+
+    struct IdleConnection {
+        Connection connection;
+        std::chrono::steady_clock::time_point returnedAt;
+    };
+
+public:
+    // Connection checked out of the pool, returned to it on destruction
+    class PooledConnection {
+    public:
+        PooledConnection(ConnectionPool* pool, Connection connection)
+            : pool(pool), connection(std::move(connection)) {}
+        PooledConnection(PooledConnection&& other) noexcept
+            : pool(other.pool), connection(std::move(other.connection)) {
+            other.pool = nullptr;
+        }
+        // The connection held so far goes back to its pool before other's is taken over
+        PooledConnection& operator=(PooledConnection&& other) noexcept {
+            if (this != &other) {
+                if (pool != nullptr && connection.connection) {
+                    pool->release(std::move(connection));
+                }
+                pool = other.pool;
+                connection = std::move(other.connection);
+                other.pool = nullptr;
+            }
+            return *this;
+        }
+        PooledConnection(const PooledConnection&) = delete;
+        PooledConnection& operator=(const PooledConnection&) = delete;
+
+        ~PooledConnection() {
+            if (pool != nullptr && connection.connection) {
+                pool->release(std::move(connection));
+            }
+        }
+
+        pqxx::connection& operator*() { return *connection.connection; }
+        pqxx::connection* operator->() { return connection.connection.get(); }
+
+        // Prepare the statement unless it already is, call it before opening a transaction
+        void prepare(const PreparedStatement& statement) {
+            if (connection.preparedStatements.count(statement.name) == 0) {
+                connection.connection->prepare(statement.name, statement.definition);
+                connection.preparedStatements.insert(statement.name);
+            }
+        }
+
+    private:
+        ConnectionPool* pool;
+        Connection connection;
+    };
+
+    ConnectionPool(std::string connectionString, ConnectionPoolOptions options = ConnectionPoolOptions())
+        : connectionString(std::move(connectionString)), options(options) {}
+
+    // Check a connection out, waiting for one to be returned when all of them are in use.
+    // Throws when none becomes available within the checkout timeout or the database can't be reached.
+    PooledConnection acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!available.wait_for(lock, options.checkoutTimeout, [&] { return !idle.empty() || nrOfOpenConnections < options.maxConnections; })) {
+            throw std::runtime_error("No database connection available after " + std::to_string(options.checkoutTimeout.count()) + " ms");
+        }
+
+        Connection connection;
+        std::chrono::steady_clock::time_point returnedAt;
+        if (!idle.empty()) {
+            connection = std::move(idle.back().connection);
+            returnedAt = idle.back().returnedAt;
+            idle.pop_back();
+        }
+        // The slot is taken before connecting, so connecting doesn't hold the lock
+        if (!connection.connection) {
+            nrOfOpenConnections++;
+        }
+        lock.unlock();
+
+        try {
+            if (connection.connection && !isHealthy(*connection.connection, returnedAt)) {
+                connection = Connection();
+            }
+            if (!connection.connection) {
+                connection.connection = connect();
+            }
+        } catch (...) {
+            discardSlot();
+            throw;
+        }
+        return PooledConnection(this, std::move(connection));
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return nrOfOpenConnections;
+    }
+
+private:
+    // Open connections are trusted, unless they were idle long enough for the server to drop them
+    bool isHealthy(pqxx::connection& connection, std::chrono::steady_clock::time_point returnedAt) const {
+        if (!connection.is_open()) {
+            return false;
+        }
+        if (std::chrono::steady_clock::now() - returnedAt < options.healthCheckInterval) {
+            return true;
+        }
+        try {
+            pqxx::nontransaction ping(connection);
+            ping.exec("SELECT 1");
+            return true;
+        } catch (const std::exception &e) {
+            std::cerr << "Dropping broken database connection: " << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    std::unique_ptr<pqxx::connection> connect() const {
+        std::chrono::milliseconds backoff = options.initialBackoff;
+        for (int attempt = 1;; attempt++) {
+            try {
+                return std::make_unique<pqxx::connection>(connectionString);
+            } catch (const std::exception &e) {
+                if (attempt >= options.maxConnectAttempts) {
+                    throw;
+                }
+                std::cerr << "Database connection attempt " << attempt << " failed, retrying in "
+                          << backoff.count() << " ms: " << e.what() << std::endl;
+                std::this_thread::sleep_for(backoff);
+                backoff = std::min(backoff * 2, options.maxBackoff);
+            }
+        }
+    }
+
+    void release(Connection connection) {
+        // A connection that broke during use is closed instead of returned
+        if (!connection.connection->is_open()) {
+            discardSlot();
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.push_back({std::move(connection), std::chrono::steady_clock::now()});
+        available.notify_one();
+    }
+
+    void discardSlot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        nrOfOpenConnections--;
+        available.notify_one();
+    }
+
+    const std::string connectionString;
+    const ConnectionPoolOptions options;
+    mutable std::mutex mutex;
+    std::condition_variable available;
+    std::vector<IdleConnection> idle;
+    // Idle plus checked out connections, including the ones being opened
+    size_t nrOfOpenConnections = 0;
+};
+
+using PooledConnection = ConnectionPool::PooledConnection;
+
+// Single pool shared by all request threads
+ConnectionPool& getConnectionPool() {
+    static ConnectionPool connectionPool(getConnectionString(), getConnectionPoolOptions());
+    return connectionPool;
+}
+
+#endif // CONNECTION_POOL_H
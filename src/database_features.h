@@ -1,369 +1,406 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <sstream>
+#include <string_view>
+#include <unordered_map>
 #include <pqxx/pqxx>
+#include "color_index.h"
 #include "compute.h"
+#include "connection_pool.h"
+#include "feature_record.h"
 #include "utils.h"
 
-void saveColorHistograms(int id, std::vector<cv::Mat> histograms);
-void saveLBPFeatures(int id, cv::Mat lbpFeatures);
-void saveHOGFeatures(int id, cv::Mat hogFeatures);
-
-//Update with winhost ip
-std::string connString = "host=172.24.96.1 port=5432 dbname=shoes user=postgres password=root";
-pqxx::connection conn(connString.c_str());
+// Writes replace many rows with one prepared statement: every column is passed as an array
+// parameter and unnested back into rows on the server, a single shoe is a batch of one.
+template <typename T>
+std::string toArrayLiteral(const std::vector<T>& values) {
+    std::ostringstream literal;
+    literal.precision(std::numeric_limits<T>::max_digits10);
+    literal << '{';
+    for (size_t i = 0; i < values.size(); i++) {
+        literal << (i == 0 ? "" : ",") << values[i];
+    }
+    literal << '}';
+    return literal.str();
+}
 
-void saveShoeProperties(int id, std::vector<cv::Mat> RGBHistograms, cv::Mat lbpHistogram, cv::Mat hogDescriptor) {
-    try {
-        if (!conn.is_open()) {
-            std::cerr << "Database connection not open" << std::endl;
-            return;
-        }
-    } catch (const std::exception &e) {
-        std::cerr << e.what() << std::endl;
-        return;
+// Append the raw data of a Mat in hex, the digits of a bytea in the hex text format
+void appendHexDigits(std::string& text, const cv::Mat& value) {
+    static const char hexDigits[] = "0123456789abcdef";
+    cv::Mat continuousValue = value.isContinuous() ? value : value.clone();
+    const uchar* bytes = continuousValue.ptr<uchar>();
+    size_t nrOfBytes = continuousValue.total() * continuousValue.elemSize();
+
+    text.reserve(text.size() + 2 * nrOfBytes + 8);
+    for (size_t byte = 0; byte < nrOfBytes; byte++) {
+        text += hexDigits[bytes[byte] >> 4];
+        text += hexDigits[bytes[byte] & 15];
     }
+}
 
-    try {
-        saveColorHistograms(id, RGBHistograms);
-        saveLBPFeatures(id, lbpHistogram);
-        saveHOGFeatures(id, hogDescriptor);
-    } catch (const std::exception &e) {
-        std::cerr << e.what() << std::endl;
-        return;
+// Bytea in the hex text format holding the raw data of the Mat
+std::string toByteaHex(const cv::Mat& value) {
+    std::string bytea = "\\x";
+    appendHexDigits(bytea, value);
+    return bytea;
+}
+
+// Array literal of bytea values holding the raw data of the Mats in hex
+std::string toByteaArrayLiteral(const std::vector<cv::Mat>& values) {
+    std::string literal = "{";
+    for (size_t i = 0; i < values.size(); i++) {
+        literal += i == 0 ? "\"\\\\x" : ",\"\\\\x";
+        appendHexDigits(literal, values[i]);
+        literal += '"';
     }
+    literal += '}';
+    return literal;
 }
 
+// Decode a bytea in the hex text format ("\x0a1b...") straight into its destination
+void decodeBytea(std::string_view bytea, void* destination, size_t nrOfBytes) {
+    if (bytea.size() != 2 + 2 * nrOfBytes || bytea[0] != '\\' || bytea[1] != 'x') {
+        throw std::runtime_error(
+            "Expected a hex encoded bytea of " + std::to_string(nrOfBytes) + " bytes, got " + std::to_string(bytea.size()) + " characters");
+    }
 
+    auto hexValue = [](char digit) -> int {
+        if (digit >= '0' && digit <= '9') return digit - '0';
+        if (digit >= 'a' && digit <= 'f') return digit - 'a' + 10;
+        if (digit >= 'A' && digit <= 'F') return digit - 'A' + 10;
+        throw std::runtime_error(std::string("Invalid hex digit ") + digit + " in bytea");
+    };
+    uchar* bytes = static_cast<uchar*>(destination);
+    for (size_t byte = 0; byte < nrOfBytes; byte++) {
+        bytes[byte] = (uchar)(hexValue(bytea[2 + 2 * byte]) << 4 | hexValue(bytea[3 + 2 * byte]));
+    }
+}
 
-void saveColorHistograms(int shoeImageId, std::vector<cv::Mat> histograms) {
-    try {
-        pqxx::work txn(conn);
-
-        pqxx::binarystring redHistBinary(reinterpret_cast<const std::byte*>(histograms[0].data), histograms[0].total() * histograms[0].elemSize());
-        pqxx::binarystring greenHistBinary(reinterpret_cast<const std::byte*>(histograms[1].data), histograms[1].total() * histograms[1].elemSize());
-        pqxx::binarystring blueHistBinary(reinterpret_cast<const std::byte*>(histograms[2].data), histograms[2].total() * histograms[2].elemSize());
-
-        txn.exec_params("INSERT INTO public.evaluate_shoehistograms (shoe_image_id, red_histogram, green_histogram, blue_histogram) VALUES ($1, $2, $3, $4)",
-            shoeImageId,
-            redHistBinary,
-            greenHistBinary,
-            blueHistBinary
-        );
-        txn.commit();
-    } catch (const std::exception& e) {
-        std::cerr << e.what() << std::endl;
+// Decode a bytea of floats into a newly allocated rows x cols Mat, a column vector when rows is 0
+cv::Mat decodeFloatBytea(std::string_view bytea, int rows = 0, int cols = 1) {
+    if (rows == 0) {
+        rows = (int)((bytea.size() - std::min<size_t>(bytea.size(), 2)) / (2 * sizeof(float)));
     }
+    cv::Mat values(rows, cols, CV_32F);
+    decodeBytea(bytea, values.ptr<float>(), values.total() * sizeof(float));
+    return values;
 }
 
-std::vector<cv::Mat> getRGBHistogramsByShoeImageId(int shoeImageId) {
-    std::vector<cv::Mat> histograms;
-    pqxx::work txn(conn);
-    try {
-        if (!conn.is_open()) {
-            std::cerr << "Can't open database" << std::endl;
-            return histograms;
-        }
+// Every write replaces what is stored for the shoes of the batch: the statement deletes their rows
+// in a data modifying CTE, which only sees the rows stored before the statement, then inserts.
+const PreparedStatement replaceShoeColorStatement{"replace_shoe_color", R"(
+    WITH replaced AS (
+        DELETE FROM public.evaluate_shoeproperties WHERE shoe_image_id = ANY($1::int[])
+    )
+    INSERT INTO public.evaluate_shoeproperties (percentage_red, percentage_green, percentage_blue, shoe_image_id)
+    SELECT percentage_red, percentage_green, percentage_blue, shoe_image_id
+    FROM unnest($1::int[], $2::float8[], $3::float8[], $4::float8[]) AS shoe (shoe_image_id, percentage_red, percentage_green, percentage_blue)
+)"};
+
+const PreparedStatement replaceDominantColorsStatement{"replace_shoe_dominant_colors", R"(
+    WITH replaced AS (
+        DELETE FROM public.evaluate_shoedominantcolor WHERE shoe_image_id = ANY($1::int[])
+    )
+    INSERT INTO public.evaluate_shoedominantcolor (red, green, blue, frequency_percentage, shoe_image_id)
+    SELECT red, green, blue, frequency_percentage, shoe_image_id
+    FROM unnest($1::int[], $2::int[], $3::int[], $4::int[], $5::float8[]) AS color (shoe_image_id, red, green, blue, frequency_percentage)
+)"};
+
+const PreparedStatement upsertProjectedHOGStatement{"upsert_shoe_hog_projection", R"(
+    INSERT INTO public.evaluate_shoehogprojection (shoe_image_id, projection, hog_projection)
+    SELECT shoe_image_id, $3, hog_projection
+    FROM unnest($1::int[], $2::bytea[]) AS shoe (shoe_image_id, hog_projection)
+    ON CONFLICT (shoe_image_id, projection) DO UPDATE SET hog_projection = EXCLUDED.hog_projection
+)"};
+
+const PreparedStatement upsertFeatureRecordsStatement{"upsert_shoe_feature_records", R"(
+    INSERT INTO public.evaluate_shoefeaturerecord (shoe_image_id, descriptor_profile, feature_record)
+    SELECT shoe_image_id, $3, feature_record
+    FROM unnest($1::int[], $2::bytea[]) AS shoe (shoe_image_id, feature_record)
+    ON CONFLICT (shoe_image_id, descriptor_profile) DO UPDATE SET feature_record = EXCLUDED.feature_record
+)"};
+
+void replaceShoeColors(pqxx::work& txn, const std::vector<int>& shoeImageIds, const std::vector<ShoeColor>& shoeColors) {
+    std::vector<double> reds, greens, blues;
+    for (const ShoeColor& shoeColor : shoeColors) {
+        reds.push_back(shoeColor.red);
+        greens.push_back(shoeColor.green);
+        blues.push_back(shoeColor.blue);
+    }
+    txn.exec_prepared(replaceShoeColorStatement.name, toArrayLiteral(shoeImageIds), toArrayLiteral(reds), toArrayLiteral(greens), toArrayLiteral(blues));
+}
 
-        pqxx::result res = txn.exec_params(
-            R"(
-                SELECT red_histogram, green_histogram, blue_histogram
-                FROM public.evaluate_shoehistograms
-                WHERE shoe_image_id = $1;
-            )",
-            shoeImageId
-        );
-
-        for (const auto& row: res) {
-            pqxx::binarystring redHistBinary = row["red_histogram"].as<pqxx::binarystring>();
-            pqxx::binarystring greenHistBinary = row["green_histogram"].as<pqxx::binarystring>();
-            pqxx::binarystring blueHistBinary = row["blue_histogram"].as<pqxx::binarystring>();
-
-            cv::Mat redHist = cv::Mat(
-                redHistBinary.size() / sizeof(float),
-                1,
-                CV_32F,
-                (void*)redHistBinary.data()
-            );
-            cv::Mat greenHist = cv::Mat(
-                greenHistBinary.size() / sizeof(float),
-                1,
-                CV_32F,
-                (void*)greenHistBinary.data()
-            );
-            cv::Mat blueHist = cv::Mat(
-                blueHistBinary.size() / sizeof(float),
-                1,
-                CV_32F,
-                (void*)blueHistBinary.data()
-            );
-
-            histograms.push_back(redHist.clone());
-            histograms.push_back(greenHist.clone());
-            histograms.push_back(blueHist.clone());
+void replaceDominantColors(pqxx::work& txn, const std::vector<int>& shoeImageIds, const std::vector<std::vector<DominantColor>>& dominantColors) {
+    std::vector<int> colorShoeImageIds, reds, greens, blues;
+    std::vector<double> percentages;
+    for (size_t i = 0; i < shoeImageIds.size(); i++) {
+        for (const DominantColor& dominantColor : dominantColors[i]) {
+            colorShoeImageIds.push_back(shoeImageIds[i]);
+            reds.push_back(dominantColor.color[2]);
+            greens.push_back(dominantColor.color[1]);
+            blues.push_back(dominantColor.color[0]);
+            percentages.push_back(dominantColor.percentage);
         }
+    }
+    if (colorShoeImageIds.empty()) {
+        return;
+    }
+    txn.exec_prepared(replaceDominantColorsStatement.name,
+        toArrayLiteral(colorShoeImageIds), toArrayLiteral(reds), toArrayLiteral(greens), toArrayLiteral(blues), toArrayLiteral(percentages));
+}
 
-
-    } catch (const std::exception &e) {
-        std::cerr << e.what() << std::endl;
+// Store the features of every shoe as a single feature record, replacing the record stored for the profile
+void upsertFeatureRecords(pqxx::work& txn, const std::vector<int>& shoeImageIds, const std::vector<ShoeProperties>& shoeProperties, const std::string& descriptorProfile) {
+    std::vector<std::vector<uchar>> records;
+    std::vector<cv::Mat> recordBytes;
+    records.reserve(shoeProperties.size());
+    for (const ShoeProperties& properties : shoeProperties) {
+        records.push_back(encodeFeatureRecord(properties, descriptorProfile));
+        recordBytes.push_back(cv::Mat(1, (int)records.back().size(), CV_8U, records.back().data()));
     }
+    txn.exec_prepared(upsertFeatureRecordsStatement.name, toArrayLiteral(shoeImageIds), toByteaArrayLiteral(recordBytes), descriptorProfile);
+}
 
-    return histograms;
+// Prepare every feature write on the connection, before its transaction is opened
+void prepareFeatureWrites(PooledConnection& conn) {
+    for (const PreparedStatement* statement : {&replaceShoeColorStatement, &replaceDominantColorsStatement, &upsertFeatureRecordsStatement}) {
+        conn.prepare(*statement);
+    }
 }
 
-std::vector<std::vector<cv::Mat>> getRGBHistograms() {
-    std::vector<std::vector<cv::Mat>> histograms;
-    pqxx::work txn(conn);
-    try {
-        if (!conn.is_open()) {
-            std::cerr << "Can't open database" << std::endl;
-            return histograms;
-        }
+// Everything stored for one shoe image when it is ingested
+struct ShoeFeatureRecord {
+    int shoeImageId;
+    ShoeProperties shoeProperties;
+    ShoeColor shoeColor;
+    // Optional, nothing is stored when empty
+    std::vector<DominantColor> dominantColors;
+};
 
-        pqxx::result res = txn.exec_params(
-            R"(
-                SELECT red_histogram, green_histogram, blue_histogram
-                FROM public.evaluate_shoehistograms;
-            )"
-        );
-        for (const auto& row: res) {
-            pqxx::binarystring redHistBinary = row["red_histogram"].as<pqxx::binarystring>();
-            pqxx::binarystring greenHistBinary = row["green_histogram"].as<pqxx::binarystring>();
-            pqxx::binarystring blueHistBinary = row["blue_histogram"].as<pqxx::binarystring>();
-
-            cv::Mat redHist = cv::Mat(
-                redHistBinary.size() / sizeof(float),
-                1,
-                CV_32F,
-                (void*)redHistBinary.data()
-            );
-            cv::Mat greenHist = cv::Mat(
-                greenHistBinary.size() / sizeof(float),
-                1,
-                CV_32F,
-                (void*)greenHistBinary.data()
-            );
-            cv::Mat blueHist = cv::Mat(
-                blueHistBinary.size() / sizeof(float),
-                1,
-                CV_32F,
-                (void*)blueHistBinary.data()
-            );
-
-            std::vector<cv::Mat> shoeHistograms;
-            shoeHistograms.push_back(redHist.clone());
-            shoeHistograms.push_back(greenHist.clone());
-            shoeHistograms.push_back(blueHist.clone());
-
-            histograms.push_back(shoeHistograms);
-        }
+// Save the features of many shoes in a single transaction with one multi-row statement per table.
+// The extracted features are only written as feature records, the separate histogram, LBP and HOG
+// tables are no longer written and only read to backfill records of shoes saved before them.
+// The colours don't depend on the descriptor profile, they are only saved with the default profile.
+// Throws when the batch can't be saved, nothing of it is stored then.
+// The resident colour indexes are updated once the batch is committed.
+void saveShoeFeatureRecords(const std::vector<ShoeFeatureRecord>& records, const std::string& descriptorProfile = defaultDescriptorProfileName) {
+    if (records.empty()) {
+        return;
+    }
 
+    std::vector<int> shoeImageIds;
+    std::vector<ShoeColor> shoeColors;
+    std::vector<std::vector<DominantColor>> dominantColors;
+    std::vector<ShoeProperties> shoeProperties;
+    for (const ShoeFeatureRecord& record : records) {
+        shoeImageIds.push_back(record.shoeImageId);
+        shoeProperties.push_back(record.shoeProperties);
+        shoeColors.push_back(record.shoeColor);
+        dominantColors.push_back(record.dominantColors);
+    }
 
-    } catch (const std::exception &e) {
-        std::cerr << e.what() << std::endl;
+    PooledConnection conn = getConnectionPool().acquire();
+    prepareFeatureWrites(conn);
+    pqxx::work txn(*conn);
+    upsertFeatureRecords(txn, shoeImageIds, shoeProperties, descriptorProfile);
+    bool saveColors = descriptorProfile == defaultDescriptorProfileName;
+    if (saveColors) {
+        replaceShoeColors(txn, shoeImageIds, shoeColors);
+        replaceDominantColors(txn, shoeImageIds, dominantColors);
     }
+    txn.commit();
 
-    return histograms;
+    if (!saveColors) {
+        return;
+    }
+    for (const ShoeFeatureRecord& record : records) {
+        getShoeColorGrid().add(record.shoeImageId, record.shoeColor);
+        if (!record.dominantColors.empty()) {
+            getDominantColorIndex().add(record.shoeImageId, record.dominantColors);
+        }
+    }
 }
 
+// Tag the separate feature tables with the descriptor profile of their rows.
+// Rows stored before profiles existed get the legacy profile, so they are never scored against cropped features.
+void ensureDescriptorProfileColumns() {
+    PooledConnection conn = getConnectionPool().acquire();
+    pqxx::work txn(*conn);
+    for (const std::string table : {"evaluate_shoehistograms", "evaluate_shoelbp", "evaluate_shoehog"}) {
+        txn.exec(
+            "ALTER TABLE public." + table + " ADD COLUMN IF NOT EXISTS descriptor_profile text NOT NULL DEFAULT " +
+            txn.quote(legacyDescriptorProfileName));
+    }
+    txn.commit();
+}
 
+// Create the table that holds one serialized feature record per shoe and descriptor profile
+void ensureFeatureRecordTable() {
+    PooledConnection conn = getConnectionPool().acquire();
+    pqxx::work txn(*conn);
+    txn.exec(R"(
+        CREATE TABLE IF NOT EXISTS public.evaluate_shoefeaturerecord (
+            shoe_image_id integer NOT NULL,
+            descriptor_profile text NOT NULL,
+            feature_record bytea NOT NULL,
+            PRIMARY KEY (shoe_image_id, descriptor_profile)
+        )
+    )");
+    txn.commit();
+}
 
-void saveLBPFeatures(int shoeImageId, cv::Mat lbpFeatures) {
-    try {
-        pqxx::work txn(conn);
-
-        std::cout << "Saving LBP features to database" << std::endl;
-        std::cout << "lbpFeatures size: " << lbpFeatures.size() << std::endl;
-        std::cout << "lbpFeatures type: " << lbpFeatures.type() << std::endl;
-
-        pqxx::binarystring lbpBinary(reinterpret_cast<std::byte*>(lbpFeatures.data), lbpFeatures.total() * lbpFeatures.elemSize());
-        int lbpRows = lbpFeatures.rows;
-        int lbpCols = lbpFeatures.cols;
+// Store the feature records of shoes whose features were read from the separate feature tables
+void saveFeatureRecords(const std::vector<int>& shoeImageIds, const std::vector<ShoeProperties>& shoeProperties, const std::string& descriptorProfile) {
+    if (shoeImageIds.empty()) {
+        return;
+    }
 
-        txn.exec_params(
-            "INSERT INTO public.evaluate_shoelbp (lbp_histogram, lbp_rows, lbp_columns, shoe_image_id) VALUES ($1, $2, $3, $4)",
-            lbpBinary,
-            lbpRows,
-            lbpCols,
-            shoeImageId
-        );
+    PooledConnection conn = getConnectionPool().acquire();
+    conn.prepare(upsertFeatureRecordsStatement);
+    pqxx::work txn(*conn);
+    upsertFeatureRecords(txn, shoeImageIds, shoeProperties, descriptorProfile);
+    txn.commit();
+}
 
+void saveShoeProperties(
+    int id,
+    std::vector<cv::Mat> RGBHistograms,
+    cv::Mat lbpHistogram,
+    cv::Mat hogDescriptor,
+    const std::string& descriptorProfile = defaultDescriptorProfileName
+) {
+    try {
+        PooledConnection conn = getConnectionPool().acquire();
+        conn.prepare(upsertFeatureRecordsStatement);
+        pqxx::work txn(*conn);
+        upsertFeatureRecords(txn, {id}, {ShoeProperties{RGBHistograms, lbpHistogram, hogDescriptor}}, descriptorProfile);
         txn.commit();
-    } catch (const std::exception& e) {
+    } catch (const std::exception &e) {
         std::cerr << e.what() << std::endl;
+        return;
     }
 }
 
-cv::Mat getLBPFeaturesByShoeImageId(int shoeImageId) {
-    cv::Mat lbpFeatures;
-    pqxx::work txn(conn);
-    try {
-        if (!conn.is_open()) {
-            std::cerr << "Can't open database" << std::endl;
-            return lbpFeatures;
-        }
 
-        pqxx::result res = txn.exec_params(
-            R"(
-                SELECT lbp_histogram, lbp_rows, lbp_columns
-                FROM public.evaluate_shoelbp
-                WHERE shoe_image_id = $1;
-            )",
-            shoeImageId
-        );
 
-        for (const auto& row : res) {
-            std::cout << "LBP histogram found" << std::endl;
-            std::cout << "LBP histogram size: " << row["lbp_histogram"].size() << std::endl;
-            pqxx::binarystring lbpBinary = row["lbp_histogram"].as<pqxx::binarystring>();
-            std::cout << "LBP histogram binary size: " << lbpBinary.size() << std::endl;
-            lbpFeatures = cv::Mat(
-                row["lbp_rows"].as<int>(),
-                row["lbp_columns"].as<int>(),
-                CV_32F,
-                (void*)lbpBinary.data()
-            );
-            std::cout << "LBP histogram size: " << lbpFeatures.size() << std::endl;
-        }
-    } catch (const std::exception &e) {
-        std::cerr << e.what() << std::endl;
+// FROM and WHERE clauses selecting the feature records of one descriptor profile, of every shoe or of the given shoes
+std::string featureRecordsSource(pqxx::work& txn, const std::vector<int>& shoeImageIds, const std::string& descriptorProfile) {
+    std::string source = " FROM public.evaluate_shoefeaturerecord WHERE descriptor_profile = " + txn.quote(descriptorProfile);
+    if (!shoeImageIds.empty()) {
+        source += " AND shoe_image_id = ANY(" + txn.quote(toArrayLiteral(shoeImageIds)) + "::int[])";
     }
+    return source;
+}
 
-    return lbpFeatures.clone();
+// Number of shoes with a feature record of one descriptor profile, of every shoe or of the given shoes
+size_t countFeatureRecords(const std::vector<int>& shoeImageIds = {}, const std::string& descriptorProfile = defaultDescriptorProfileName) {
+    PooledConnection conn = getConnectionPool().acquire();
+    pqxx::work txn(*conn);
+    return txn.exec("SELECT count(*) " + featureRecordsSource(txn, shoeImageIds, descriptorProfile))[0][0].as<size_t>();
 }
 
-std::vector<cv::Mat> getLBPHistograms() {
-    std::vector<cv::Mat> lbpHistograms;
-    pqxx::work txn(conn);
-    try {
-        if (!conn.is_open()) {
-            std::cerr << "Can't open database" << std::endl;
-            return lbpHistograms;
+// Stream the feature records of one descriptor profile with COPY, a single column of a single table.
+// Every record is decoded into one reused aligned buffer and handed to onRow as a view over it,
+// the view is only valid during the call. Records that fail validation are logged and skipped.
+void streamFeatureRecords(
+    const std::function<void(int, const FeatureRecordView&)>& onRow,
+    const std::vector<int>& shoeImageIds = {},
+    const std::string& descriptorProfile = defaultDescriptorProfileName
+) {
+    PooledConnection conn = getConnectionPool().acquire();
+    pqxx::work txn(*conn);
+    pqxx::stream_from stream = pqxx::stream_from::query(txn,
+        "SELECT shoe_image_id, feature_record " + featureRecordsSource(txn, shoeImageIds, descriptorProfile));
+
+    // Mat allocations are aligned well beyond featureRecordAlignment
+    cv::Mat recordBuffer;
+    while (const std::vector<pqxx::zview>* fields = stream.read_row()) {
+        int shoeImageId = std::atoi((*fields)[0].c_str());
+        std::string_view bytea = (*fields)[1];
+        size_t recordSize = (bytea.size() - std::min<size_t>(bytea.size(), 2)) / 2;
+        if (recordBuffer.total() < recordSize) {
+            recordBuffer.create(1, (int)recordSize, CV_8U);
         }
 
-        pqxx::result res = txn.exec_params(
-            R"(
-                SELECT lbp_histogram, lbp_rows, lbp_columns
-                FROM public.evaluate_shoelbp;
-            )"
-        );
-
-        for (const auto& row : res) {
-            pqxx::binarystring lbpBinary = row["lbp_histogram"].as<pqxx::binarystring>();
-            cv::Mat lbpHistogram = cv::Mat(
-                row["lbp_rows"].as<int>(),
-                row["lbp_columns"].as<int>(),
-                CV_32F,
-                (void*)lbpBinary.data()
-            );
-            lbpHistograms.push_back(lbpHistogram.clone());
+        try {
+            decodeBytea(bytea, recordBuffer.data, recordSize);
+            FeatureRecordView record(recordBuffer.data, recordSize);
+            if (record.descriptorProfile() != descriptorProfile) {
+                throw std::runtime_error("Feature record of profile " + record.descriptorProfile() + " is stored as " + descriptorProfile);
+            }
+            onRow(shoeImageId, record);
+        } catch (const std::exception &e) {
+            std::cerr << "Skipping feature record of shoe image " << shoeImageId << ": " << e.what() << std::endl;
         }
-    } catch (const std::exception &e) {
-        std::cerr << e.what() << std::endl;
     }
-
-    return lbpHistograms;
+    stream.complete();
+    txn.commit();
 }
 
-
-
-void saveHOGFeatures(int shoeImageId, cv::Mat hogFeatures) {
+// Features stored in the feature record of one shoe, empty Mats when it has none
+ShoeProperties getShoePropertiesByShoeImageId(int shoeImageId, const std::string& descriptorProfile = defaultDescriptorProfileName) {
+    ShoeProperties shoeProperties;
     try {
-        pqxx::work txn(conn);
-
-        std::cout << "Saving HOG features to database" << std::endl;
-        std::cout << "hogFeatures size: " << hogFeatures.size() << std::endl;
-        std::cout << "hogFeatures type: " << hogFeatures.type() << std::endl;
-
-        pqxx::binarystring hogBinary(reinterpret_cast<std::byte*>(hogFeatures.data), hogFeatures.total() * hogFeatures.elemSize());
-        int hogRows = hogFeatures.rows;
-        int hogCols = hogFeatures.cols;
-
-        txn.exec_params(
-            "INSERT INTO public.evaluate_shoehog (hog_descriptor, hog_rows, hog_columns, shoe_image_id) VALUES ($1, $2, $3, $4)",
-            hogBinary,
-            hogRows,
-            hogCols,
-            shoeImageId
-        );
-        txn.commit();
-    } catch (const std::exception& e) {
+        streamFeatureRecords([&](int, const FeatureRecordView& record) {
+            shoeProperties = record.toShoeProperties();
+        }, {shoeImageId}, descriptorProfile);
+    } catch (const std::exception &e) {
         std::cerr << e.what() << std::endl;
     }
+    return shoeProperties;
 }
 
-cv::Mat getHOGFeaturesByShoeImageId(int shoe_image_id) {
-    cv::Mat hogFeatures;
-    pqxx::work txn(conn);
+// Copy one payload out of the feature record of every shoe
+std::vector<cv::Mat> getFeatureRecordPayloads(FeatureRecordPayload payload, const std::string& descriptorProfile) {
+    std::vector<cv::Mat> payloads;
     try {
-        if (!conn.is_open()) {
-            std::cerr << "Can't open database" << std::endl;
-            return hogFeatures;
-        }
-
-        pqxx::result res = txn.exec_params(
-            R"(
-                SELECT hog_descriptor, hog_rows, hog_columns
-                FROM public.evaluate_shoehog
-                WHERE shoe_image_id = $1;
-            )",
-            shoe_image_id
-        );
-
-        for (const auto& row : res) {
-            std::cout << "HOG descriptor found" << std::endl;
-            std::cout << "HOG descriptor size: " << row["hog_descriptor"].size() << std::endl;
-            pqxx::binarystring hogBinary = row["hog_descriptor"].as<pqxx::binarystring>();
-            std::cout << "HOG descriptor binary size: " << hogBinary.size() << std::endl;
-
-            hogFeatures = cv::Mat(
-                row["hog_rows"].as<int>(),
-                row["hog_columns"].as<int>(),
-                CV_32F,
-                (void*)hogBinary.data()
-            );
-            std::cout << "HOG descriptor size: " << hogFeatures.size() << std::endl;
-        }
+        streamFeatureRecords([&](int, const FeatureRecordView& record) {
+            payloads.push_back(record.payload(payload).clone());
+        }, {}, descriptorProfile);
     } catch (const std::exception &e) {
         std::cerr << e.what() << std::endl;
     }
+    return payloads;
+}
 
-    return hogFeatures.clone();
+std::vector<cv::Mat> getRGBHistogramsByShoeImageId(int shoeImageId, const std::string& descriptorProfile = defaultDescriptorProfileName) {
+    return getShoePropertiesByShoeImageId(shoeImageId, descriptorProfile).rgbHistograms;
 }
 
-std::vector<cv::Mat> getHOGFeatures() {
-    std::vector<cv::Mat> hogFeatures;
-    pqxx::work txn(conn);
+std::vector<std::vector<cv::Mat>> getRGBHistograms(const std::string& descriptorProfile = defaultDescriptorProfileName) {
+    std::vector<std::vector<cv::Mat>> histograms;
     try {
-        if (!conn.is_open()) {
-            std::cerr << "Can't open database" << std::endl;
-            return hogFeatures;
-        }
-
-        pqxx::result res = txn.exec_params(
-            R"(
-                SELECT hog_descriptor, hog_rows, hog_columns
-                FROM public.evaluate_shoehog;
-            )"
-        );
-
-        for (const auto& row : res) {
-            pqxx::binarystring hogBinary = row["hog_descriptor"].as<pqxx::binarystring>();
-            cv::Mat hogDescriptor = cv::Mat(
-                row["hog_rows"].as<int>(),
-                row["hog_columns"].as<int>(),
-                CV_32F,
-                (void*)hogBinary.data()
-            );
-            hogFeatures.push_back(hogDescriptor.clone());
-        }
+        streamFeatureRecords([&](int, const FeatureRecordView& record) {
+            histograms.push_back({
+                record.payload(RedHistogramPayload).clone(),
+                record.payload(GreenHistogramPayload).clone(),
+                record.payload(BlueHistogramPayload).clone()
+            });
+        }, {}, descriptorProfile);
     } catch (const std::exception &e) {
         std::cerr << e.what() << std::endl;
     }
+    return histograms;
+}
 
-    return hogFeatures;
+cv::Mat getLBPFeaturesByShoeImageId(int shoeImageId, const std::string& descriptorProfile = defaultDescriptorProfileName) {
+    return getShoePropertiesByShoeImageId(shoeImageId, descriptorProfile).lbpHistogram;
+}
+
+std::vector<cv::Mat> getLBPHistograms(const std::string& descriptorProfile = defaultDescriptorProfileName) {
+    return getFeatureRecordPayloads(LBPHistogramPayload, descriptorProfile);
+}
+
+cv::Mat getHOGFeaturesByShoeImageId(int shoeImageId, const std::string& descriptorProfile = defaultDescriptorProfileName) {
+    return getShoePropertiesByShoeImageId(shoeImageId, descriptorProfile).hogFeatures;
+}
 
+std::vector<cv::Mat> getHOGFeatures(const std::string& descriptorProfile = defaultDescriptorProfileName) {
+    return getFeatureRecordPayloads(HOGPayload, descriptorProfile);
 }
 
 
@@ -376,103 +413,67 @@ struct ShoePropertiesList {
     std::vector<cv::Mat> HOGFeatures;
 };
 
-ShoePropertiesList getShoeProperties() {
+// Return the features stored in the feature records of one descriptor profile.
+// If shoeImageIds is not empty only the properties of those shoe images are fetched
+ShoePropertiesList getShoeProperties(const std::vector<int>& shoeImageIds = {}, const std::string& descriptorProfile = defaultDescriptorProfileName) {
+    ShoePropertiesList shoePropertiesList;
+    try {
+        streamFeatureRecords([&](int shoeImageId, const FeatureRecordView& record) {
+            ShoeProperties shoeProperties = record.toShoeProperties();
+            shoePropertiesList.shoeImageIds.push_back(shoeImageId);
+            shoePropertiesList.RGBHistograms.push_back(shoeProperties.rgbHistograms);
+            shoePropertiesList.LBPHistograms.push_back(shoeProperties.lbpHistogram);
+            shoePropertiesList.HOGFeatures.push_back(shoeProperties.hogFeatures);
+        }, shoeImageIds, descriptorProfile);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+    }
+
+    return shoePropertiesList;
+}
+
+// Return the features of one descriptor profile from the separate histogram, LBP and HOG tables.
+// They are no longer written, this is only the read path to backfill the records of shoes saved before them.
+// If shoeImageIds is not empty only the properties of those shoe images are fetched
+ShoePropertiesList getLegacyShoeProperties(const std::vector<int>& shoeImageIds = {}, const std::string& descriptorProfile = defaultDescriptorProfileName) {
     ShoePropertiesList shoePropertiesList;
-    pqxx::work txn(conn);
+    PooledConnection conn = getConnectionPool().acquire();
+    pqxx::work txn(*conn);
     try {
-        if (!conn.is_open()) {
+        if (!conn->is_open()) {
             std::cerr << "Can't open database" << std::endl;
             return shoePropertiesList;
         }
 
-        pqxx::result res = txn.exec(
-            R"(
-                SELECT hist.shoe_image_id, red_histogram, green_histogram, blue_histogram,
-                    lbp_histogram, lbp_rows, lbp_columns,
-                    hog_descriptor, hog_rows, hog_columns
-                FROM public.evaluate_shoehistograms as hist
-                JOIN public.evaluate_shoelbp as lbp ON hist.shoe_image_id = lbp.shoe_image_id
-                JOIN public.evaluate_shoehog as hog ON hist.shoe_image_id = hog.shoe_image_id;
-            )"
-        );
+        std::string query = R"(
+            SELECT hist.shoe_image_id, red_histogram, green_histogram, blue_histogram,
+                lbp_histogram, lbp_rows, lbp_columns,
+                hog_descriptor, hog_rows, hog_columns
+            FROM public.evaluate_shoehistograms as hist
+            JOIN public.evaluate_shoelbp as lbp ON hist.shoe_image_id = lbp.shoe_image_id
+            JOIN public.evaluate_shoehog as hog ON hist.shoe_image_id = hog.shoe_image_id
+            WHERE hist.descriptor_profile = )" + txn.quote(descriptorProfile) + " AND lbp.descriptor_profile = " + txn.quote(descriptorProfile) +
+            " AND hog.descriptor_profile = " + txn.quote(descriptorProfile);
+        if (!shoeImageIds.empty()) {
+            // Pass the ids as a single postgres array literal
+            query += " AND hist.shoe_image_id = ANY(" + txn.quote(toArrayLiteral(shoeImageIds)) + "::int[])";
+        }
+        pqxx::result res = txn.exec(query);
 
+        shoePropertiesList.shoeImageIds.reserve(res.size());
+        shoePropertiesList.RGBHistograms.reserve(res.size());
+        shoePropertiesList.LBPHistograms.reserve(res.size());
+        shoePropertiesList.HOGFeatures.reserve(res.size());
         for (const auto& row : res) {
-            int shoeImageId = row["shoe_image_id"].as<int>();
-
-            pqxx::binarystring redHistBinary = row["red_histogram"].as<pqxx::binarystring>();
-            pqxx::binarystring greenHistBinary = row["green_histogram"].as<pqxx::binarystring>();
-            pqxx::binarystring blueHistBinary = row["blue_histogram"].as<pqxx::binarystring>();
-
-            pqxx::binarystring lbpBinary = row["lbp_histogram"].as<pqxx::binarystring>();
-            pqxx::binarystring hogBinary = row["hog_descriptor"].as<pqxx::binarystring>();
-
-            //test print all extracted data
-            // std::cout << "hist shoeimageid: " << shoeImageId << std::endl;
-            // std::cout << "redHistBinary size: " << redHistBinary.size() << std::endl;
-            // std::cout << "greenHistBinary size: " << greenHistBinary.size() << std::endl;
-            // std::cout << "blueHistBinary size: " << blueHistBinary.size() << std::endl;
-            // std::cout << "lbpBinary size: " << lbpBinary.size() << std::endl;
-            // std::cout << "hogBinary size: " << hogBinary.size() << std::endl;
-            // std::cout << std::endl;
-
-            // std::cout << "before converting mat" << std::endl;
-            // cv::Mat redHist = binarystringToMat(redHistBinary);
-            // cv::Mat greenHist = binarystringToMat(greenHistBinary);
-            // cv::Mat blueHist = binarystringToMat(blueHistBinary);
-
-            // std::cout << "before converting lbp and hog" << std::endl;
-            // cv::Mat lbpFeatures = binarystringToMat(lbpBinary, row["lbp_rows"].as<int>(), row["lbp_columns"].as<int>());
-            // cv::Mat hogFeatures = binarystringToMat(hogBinary, row["hog_rows"].as<int>(), row["hog_columns"].as<int>());
-
-            cv::Mat redHist = cv::Mat(
-                redHistBinary.size() / sizeof(float),
-                1,
-                CV_32F,
-                (void*)redHistBinary.data()
-            );
-            cv::Mat greenHist = cv::Mat(
-                greenHistBinary.size() / sizeof(float),
-                1,
-                CV_32F,
-                (void*)greenHistBinary.data()
-            );
-            cv::Mat blueHist = cv::Mat(
-                blueHistBinary.size() / sizeof(float),
-                1,
-                CV_32F,
-                (void*)blueHistBinary.data()
-            );
-
-            cv::Mat lbpFeatures = cv::Mat(
-                row["lbp_rows"].as<int>(),
-                row["lbp_columns"].as<int>(),
-                CV_32F,
-                (void*)lbpBinary.data()
-            );
-            cv::Mat hogFeatures = cv::Mat(
-                row["hog_rows"].as<int>(),
-                row["hog_columns"].as<int>(),
-                CV_32F,
-                (void*)hogBinary.data()
-            );
-
-            // std::cout << "after converting mat" << std::endl;
-            shoePropertiesList.shoeImageIds.push_back(shoeImageId);
-
-            std::vector<cv::Mat> shoeHistograms;
-            // std::cout << "shoeHistograms size: " << shoeHistograms.size() << std::endl;
-            shoeHistograms.push_back(redHist.clone());
-            // std::cout << "shoeHistograms size: " << shoeHistograms.size() << std::endl;
-            shoeHistograms.push_back(greenHist.clone());
-            shoeHistograms.push_back(blueHist.clone());
-            // std::cout << "shoeHistograms size: " << shoeHistograms.size() << std::endl;
-
-            shoePropertiesList.RGBHistograms.push_back(shoeHistograms);
-            // std::cout << "RGBHistograms size: " << shoePropertiesList.RGBHistograms.size() << std::endl;
-            shoePropertiesList.LBPHistograms.push_back(lbpFeatures.clone());
-            // std::cout << "LBPHistograms size: " << shoePropertiesList.LBPHistograms.size() << std::endl;
-            shoePropertiesList.HOGFeatures.push_back(hogFeatures.clone());
-            // std::cout << "HOGFeatures size: " << shoePropertiesList.HOGFeatures.size() << std::endl;
+            // Columns are addressed in the order of the SELECT list, every bytea is decoded once into its Mat
+            shoePropertiesList.shoeImageIds.push_back(row[0].as<int>());
+            shoePropertiesList.RGBHistograms.push_back({
+                decodeFloatBytea(row[1].view()),
+                decodeFloatBytea(row[2].view()),
+                decodeFloatBytea(row[3].view())
+            });
+            shoePropertiesList.LBPHistograms.push_back(decodeFloatBytea(row[4].view(), row[5].as<int>(), row[6].as<int>()));
+            shoePropertiesList.HOGFeatures.push_back(decodeFloatBytea(row[7].view(), row[8].as<int>(), row[9].as<int>()));
         }
     } catch (const std::exception &e) {
         std::cerr << e.what() << std::endl;
@@ -481,6 +482,142 @@ ShoePropertiesList getShoeProperties() {
     return shoePropertiesList;
 }
 
+// Bulk load the features of many shoes, e.g. when the whole catalogue is recalculated.
+// The rows are copied into temporary staging tables with COPY, then a single statement replaces
+// the stored rows of the staged shoes: the feature records of the descriptor profile, and with the default
+// profile the mean colours and the dominant colours of the shoes that have some staged. Throws when the batch can't be saved, nothing of it is stored then.
+// Unlike saveShoeFeatureRecords the resident indexes are not updated, reload them after the last batch.
+// Returns the number of shoes that were stored.
+size_t bulkSaveShoeFeatureRecords(const std::vector<ShoeFeatureRecord>& records, const std::string& descriptorProfile = defaultDescriptorProfileName) {
+    if (records.empty()) {
+        return 0;
+    }
+
+    PooledConnection conn = getConnectionPool().acquire();
+    pqxx::work txn(*conn);
+    txn.exec(R"(
+        CREATE TEMP TABLE staging_shoeproperties (shoe_image_id integer, percentage_red float8, percentage_green float8, percentage_blue float8) ON COMMIT DROP;
+        CREATE TEMP TABLE staging_shoedominantcolor (shoe_image_id integer, red integer, green integer, blue integer, frequency_percentage float8) ON COMMIT DROP;
+        CREATE TEMP TABLE staging_shoefeaturerecord (shoe_image_id integer, feature_record bytea) ON COMMIT DROP;
+    )");
+
+    // Every staging table is filled by its own COPY, one table at a time
+    {
+        pqxx::stream_to featureRecords = pqxx::stream_to::table(txn, {"staging_shoefeaturerecord"});
+        for (const ShoeFeatureRecord& record : records) {
+            std::vector<uchar> featureRecord = encodeFeatureRecord(record.shoeProperties, descriptorProfile);
+            featureRecords.write_values(record.shoeImageId, toByteaHex(cv::Mat(1, (int)featureRecord.size(), CV_8U, featureRecord.data())));
+        }
+        featureRecords.complete();
+    }
+    // The colours don't depend on the descriptor profile, they are only replaced with the default profile
+    if (descriptorProfile == defaultDescriptorProfileName) {
+        pqxx::stream_to colors = pqxx::stream_to::table(txn, {"staging_shoeproperties"});
+        for (const ShoeFeatureRecord& record : records) {
+            colors.write_values(record.shoeImageId, (double)record.shoeColor.red, (double)record.shoeColor.green, (double)record.shoeColor.blue);
+        }
+        colors.complete();
+    }
+    if (descriptorProfile == defaultDescriptorProfileName) {
+        pqxx::stream_to dominantColors = pqxx::stream_to::table(txn, {"staging_shoedominantcolor"});
+        for (const ShoeFeatureRecord& record : records) {
+            for (const DominantColor& dominantColor : record.dominantColors) {
+                dominantColors.write_values(record.shoeImageId,
+                    (int)dominantColor.color[2], (int)dominantColor.color[1], (int)dominantColor.color[0], (double)dominantColor.percentage);
+            }
+        }
+        dominantColors.complete();
+    }
+
+    // Data modifying CTEs all see the tables as they were before the statement,
+    // so the deletes only remove the previously stored rows
+    pqxx::result merged = txn.exec_params(R"(
+        WITH deleted_colors AS (
+            DELETE FROM public.evaluate_shoeproperties AS stored USING staging_shoeproperties AS staged
+            WHERE stored.shoe_image_id = staged.shoe_image_id
+        ), deleted_dominant_colors AS (
+            DELETE FROM public.evaluate_shoedominantcolor AS stored
+            WHERE stored.shoe_image_id IN (SELECT shoe_image_id FROM staging_shoedominantcolor)
+        ), inserted_colors AS (
+            INSERT INTO public.evaluate_shoeproperties (percentage_red, percentage_green, percentage_blue, shoe_image_id)
+            SELECT percentage_red, percentage_green, percentage_blue, shoe_image_id FROM staging_shoeproperties
+        ), inserted_dominant_colors AS (
+            INSERT INTO public.evaluate_shoedominantcolor (red, green, blue, frequency_percentage, shoe_image_id)
+            SELECT red, green, blue, frequency_percentage, shoe_image_id FROM staging_shoedominantcolor
+        ), upserted_feature_records AS (
+            INSERT INTO public.evaluate_shoefeaturerecord (shoe_image_id, descriptor_profile, feature_record)
+            SELECT shoe_image_id, $1, feature_record FROM staging_shoefeaturerecord
+            ON CONFLICT (shoe_image_id, descriptor_profile) DO UPDATE SET feature_record = EXCLUDED.feature_record
+            RETURNING shoe_image_id
+        )
+        SELECT count(*) FROM upserted_feature_records
+    )", descriptorProfile);
+    txn.commit();
+
+    return merged[0][0].as<size_t>();
+}
+
+// Create the table that holds the PCA reduced HOG features, next to the raw ones in the feature records
+void ensureProjectedHOGTable() {
+    PooledConnection conn = getConnectionPool().acquire();
+    pqxx::work txn(*conn);
+    txn.exec(R"(
+        CREATE TABLE IF NOT EXISTS public.evaluate_shoehogprojection (
+            shoe_image_id integer NOT NULL,
+            projection text NOT NULL,
+            hog_projection bytea NOT NULL,
+            PRIMARY KEY (shoe_image_id, projection)
+        )
+    )");
+    txn.commit();
+}
+
+// Save the reduced HOG features of several shoes in one transaction, one projected row per shoe
+void saveProjectedHOGFeatures(const std::vector<int>& shoeImageIds, const cv::Mat& projectedRows, const std::string& projection) {
+    if (projectedRows.type() != CV_32F || projectedRows.rows != (int)shoeImageIds.size()) {
+        throw std::runtime_error("Expected one float row of projected HOG features per shoe");
+    }
+
+    std::vector<cv::Mat> projectedHOGFeatures;
+    for (int row = 0; row < projectedRows.rows; row++) {
+        projectedHOGFeatures.push_back(projectedRows.row(row));
+    }
+
+    PooledConnection conn = getConnectionPool().acquire();
+    conn.prepare(upsertProjectedHOGStatement);
+    pqxx::work txn(*conn);
+    // Bounded batches keep the array parameters of a statement at a few MB
+    const size_t batchSize = 1000;
+    for (size_t begin = 0; begin < shoeImageIds.size(); begin += batchSize) {
+        size_t end = std::min(begin + batchSize, shoeImageIds.size());
+        txn.exec_prepared(upsertProjectedHOGStatement.name,
+            toArrayLiteral(std::vector<int>(shoeImageIds.begin() + begin, shoeImageIds.begin() + end)),
+            toByteaArrayLiteral(std::vector<cv::Mat>(projectedHOGFeatures.begin() + begin, projectedHOGFeatures.begin() + end)),
+            projection);
+    }
+    txn.commit();
+}
+
+// Return the reduced HOG features stored for a projection, by shoe image id
+std::unordered_map<int, cv::Mat> getProjectedHOGFeatures(const std::string& projection) {
+    std::unordered_map<int, cv::Mat> projectedHOGFeatures;
+    PooledConnection conn = getConnectionPool().acquire();
+    if (!conn->is_open()) {
+        std::cerr << "Can't open database" << std::endl;
+        return projectedHOGFeatures;
+    }
+
+    pqxx::work txn(*conn);
+    pqxx::result res = txn.exec_params(
+        "SELECT shoe_image_id, hog_projection FROM public.evaluate_shoehogprojection WHERE projection = $1", projection);
+    for (const auto& row : res) {
+        pqxx::binarystring projectedBinary = row["hog_projection"].as<pqxx::binarystring>();
+        cv::Mat projectedRow(1, projectedBinary.size() / sizeof(float), CV_32F, (void*)projectedBinary.data());
+        projectedHOGFeatures[row["shoe_image_id"].as<int>()] = projectedRow.clone();
+    }
+    return projectedHOGFeatures;
+}
+
 
 
 
@@ -491,21 +628,14 @@ void saveShoeColor(int id, ShoeColor shoeColor) {
     std::cout << "Shoe color blue: " << shoeColor.blue << std::endl;
 
     try {
-        if (!conn.is_open()) {
-            std::cerr << "Database connection not open" << std::endl;
-            return;
-        }
-    } catch (const std::exception &e) {
-        std::cerr << e.what() << std::endl;
-        return;
-    }
-
-    try {
-        pqxx::work txn(conn);
-        std::cout << "INSERT INTO public.evaluate_shoeproperties (percentage_red,percentage_green,percentage_blue,shoe_image_id) VALUES (" + txn.quote(shoeColor.red) + "," + txn.quote(shoeColor.green) + "," + txn.quote(shoeColor.blue) + "," + txn.quote(id) + ")" << std::endl;
+        PooledConnection conn = getConnectionPool().acquire();
+        conn.prepare(replaceShoeColorStatement);
+        pqxx::work txn(*conn);
 
-        txn.exec("INSERT INTO public.evaluate_shoeproperties (percentage_red,percentage_green,percentage_blue,shoe_image_id) VALUES (" + txn.quote(shoeColor.red) + "," + txn.quote(shoeColor.green) + "," + txn.quote(shoeColor.blue) + "," + txn.quote(id) + ")");
+        replaceShoeColors(txn, {id}, {shoeColor});
         txn.commit();
+        // Keep the resident color grid in sync with the table
+        getShoeColorGrid().add(id, shoeColor);
     } catch (const std::exception &e) {
         std::cerr << e.what() << std::endl;
         return;
@@ -517,28 +647,14 @@ void saveDominantColors(int id, std::vector<DominantColor> dominantColors) {
     std::cout << "ID: " << id << std::endl;
 
     try {
-        if (!conn.is_open()) {
-            std::cerr << "Database connection not open" << std::endl;
-            return;
-        }
-    } catch (const std::exception &e) {
-        std::cerr << e.what() << std::endl;
-        return;
-    }
-
-    try {
-        pqxx::work txn(conn);
-
-        for (DominantColor dominantColor: dominantColors) {
-            int red = dominantColor.color[2];
-            int green = dominantColor.color[1];
-            int blue = dominantColor.color[0];
-            // std::cout << "INSERT INTO public.evaluate_shoedominantcolor (red,green,blue,frequency_percentage,shoe_image_id) VALUES (" + txn.quote(red) + "," + txn.quote(green) + "," + txn.quote(blue) + "," + txn.quote(dominantColor.percentage) + "," + txn.quote(id) + ")" << std::endl;
-
-            txn.exec("INSERT INTO public.evaluate_shoedominantcolor (red,green,blue,frequency_percentage,shoe_image_id) VALUES (" + txn.quote(red) + "," + txn.quote(green) + "," + txn.quote(blue) + "," + txn.quote(dominantColor.percentage) + "," + txn.quote(id) + ")");
-        }
+        PooledConnection conn = getConnectionPool().acquire();
+        conn.prepare(replaceDominantColorsStatement);
+        pqxx::work txn(*conn);
 
+        replaceDominantColors(txn, {id}, {dominantColors});
         txn.commit();
+        // Keep the resident color index in sync with the table
+        getDominantColorIndex().add(id, dominantColors);
     } catch (const std::exception &e) {
         std::cerr << e.what() << std::endl;
         return;
@@ -550,7 +666,8 @@ void saveDominantColors(int id, std::vector<DominantColor> dominantColors) {
 // Method to test PostgreSQL connection
 void testGetShoeMetadata() {
     try {
-        pqxx::work txn(conn);
+        PooledConnection conn = getConnectionPool().acquire();
+        pqxx::work txn(*conn);
 
         for (auto row: txn.exec("SELECT price FROM public.evaluate_shoemetadata")) {
             std::cout << row[0].as<float>() << std::endl;
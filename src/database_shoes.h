@@ -9,7 +9,8 @@
 
 void getShoeImages() {
     try {
-        pqxx::work txn(conn);
+        PooledConnection conn = getConnectionPool().acquire();
+        pqxx::work txn(*conn);
 
         for (auto row: txn.exec("SELECT * FROM public.evaluate_shoeimage")) {
             std::cout << row[0].as<int>() << std::endl;
@@ -22,13 +23,14 @@ void getShoeImages() {
 std::vector<int> getShoeImagesWithSimilarColor(ShoeColor shoecolor) {
     std::vector<int> shoeIds;
 
-    if (!conn.is_open()) {
+    PooledConnection conn = getConnectionPool().acquire();
+    if (!conn->is_open()) {
         std::cerr << "Can't open database" << std::endl;
         return shoeIds;
     }
 
     // Create a transactional object to execute the query
-    pqxx::work txn(conn);
+    pqxx::work txn(*conn);
 
     std::string dbQuery = R"(
         SELECT shoe_image_id,
@@ -51,13 +53,40 @@ std::vector<int> getShoeImagesWithSimilarColor(ShoeColor shoecolor) {
     return shoeIds;
 }
 
+// Return the mean color percentages of every shoe image in evaluate_shoeproperties
+std::vector<std::pair<int, ShoeColor>> getShoeColors() {
+    PooledConnection conn = getConnectionPool().acquire();
+    if (!conn->is_open()) {
+        throw std::runtime_error("Can't open database");
+    }
+
+    pqxx::work txn(*conn);
+
+    pqxx::result res = txn.exec(R"(
+        SELECT shoe_image_id, percentage_red, percentage_green, percentage_blue
+        FROM public.evaluate_shoeproperties;
+    )");
+
+    std::vector<std::pair<int, ShoeColor>> shoeColors;
+    for (const auto& row : res) {
+        ShoeColor shoeColor;
+        shoeColor.red = row["percentage_red"].as<float>();
+        shoeColor.green = row["percentage_green"].as<float>();
+        shoeColor.blue = row["percentage_blue"].as<float>();
+        shoeColors.emplace_back(row["shoe_image_id"].as<int>(), shoeColor);
+    }
+
+    return shoeColors;
+}
+
 std::map<int, std::vector<DominantColor>> getShoeImagesWithDominantColors() {
-    if (!conn.is_open()) {
+    PooledConnection conn = getConnectionPool().acquire();
+    if (!conn->is_open()) {
         throw std::runtime_error("Can't open database");
     }
 
     // Create a transactional object to execute the query
-    pqxx::work txn(conn);
+    pqxx::work txn(*conn);
 
     std::string dbQuery = R"(
         SELECT shoe_image_id, red, green, blue, frequency_percentage
@@ -84,12 +113,89 @@ std::map<int, std::vector<DominantColor>> getShoeImagesWithDominantColors() {
     return shoeImageColors;
 }
 
+// Return the ids of the first maxNrOfShoeImages shoe images
+std::vector<int> getShoeImageIds(int maxNrOfShoeImages) {
+    PooledConnection conn = getConnectionPool().acquire();
+    if (!conn->is_open()) {
+        throw std::runtime_error("Can't open database");
+    }
+
+    pqxx::work txn(*conn);
+
+    pqxx::result res = txn.exec_params("SELECT id FROM public.evaluate_shoeimage ORDER BY id LIMIT $1;", maxNrOfShoeImages);
+
+    std::vector<int> shoeImageIds;
+    for (const auto& row : res) {
+        shoeImageIds.push_back(row[0].as<int>());
+    }
+
+    return shoeImageIds;
+}
+
+// Return the ids of every shoe image
+std::vector<int> getAllShoeImageIds() {
+    return getShoeImageIds(std::numeric_limits<int>::max());
+}
+
+// Return the encoded images of the given shoe images, in the order of their ids.
+// Ids without an image are left out.
+std::vector<std::pair<int, std::vector<uchar>>> getEncodedShoeImages(const std::vector<int>& shoeImageIds) {
+    PooledConnection conn = getConnectionPool().acquire();
+    if (!conn->is_open()) {
+        throw std::runtime_error("Can't open database");
+    }
+
+    pqxx::work txn(*conn);
+
+    pqxx::result res = txn.exec_params(
+        "SELECT id, image FROM public.evaluate_shoeimage WHERE id = ANY($1::integer[]) ORDER BY id;",
+        toArrayLiteral(shoeImageIds)
+    );
+
+    std::vector<std::pair<int, std::vector<uchar>>> encodedImages;
+    encodedImages.reserve(res.size());
+    for (const auto& row : res) {
+        pqxx::binarystring imageBinary = row[1].as<pqxx::binarystring>();
+        const uchar* imageData = (const uchar*)imageBinary.data();
+        encodedImages.emplace_back(row[0].as<int>(), std::vector<uchar>(imageData, imageData + imageBinary.size()));
+    }
+
+    return encodedImages;
+}
+
+// Return the ids of the shoe images that have no dominant colors stored yet
+std::vector<int> getShoeImageIdsWithoutDominantColors() {
+    PooledConnection conn = getConnectionPool().acquire();
+    if (!conn->is_open()) {
+        throw std::runtime_error("Can't open database");
+    }
+
+    pqxx::work txn(*conn);
+
+    pqxx::result res = txn.exec(R"(
+        SELECT im.id
+        FROM public.evaluate_shoeimage AS im
+        WHERE NOT EXISTS (
+            SELECT 1 FROM public.evaluate_shoedominantcolor AS dc WHERE dc.shoe_image_id = im.id
+        )
+        ORDER BY im.id;
+    )");
+
+    std::vector<int> shoeImageIds;
+    for (const auto& row : res) {
+        shoeImageIds.push_back(row[0].as<int>());
+    }
+
+    return shoeImageIds;
+}
+
 cv::Mat getShoeImageByRGBHistogramID(int rgbHistId) {
-    if (!conn.is_open()) {
+    PooledConnection conn = getConnectionPool().acquire();
+    if (!conn->is_open()) {
         throw std::runtime_error("Can't open database");
     }
 
-    pqxx::work txn(conn);
+    pqxx::work txn(*conn);
 
     // Execute the query
     pqxx::result res = txn.exec_params(
@@ -118,11 +224,12 @@ cv::Mat getShoeImageByRGBHistogramID(int rgbHistId) {
 }
 
 cv::Mat getShoeImageByID(int id) {
-    if (!conn.is_open()) {
+    PooledConnection conn = getConnectionPool().acquire();
+    if (!conn->is_open()) {
         throw std::runtime_error("Can't open database");
     }
 
-    pqxx::work txn(conn);
+    pqxx::work txn(*conn);
 
     // Execute the query
     pqxx::result res = txn.exec_params(
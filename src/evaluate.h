@@ -2,7 +2,10 @@
 #define EVALUATE_H
 
 #include <pqxx/pqxx>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <string>
 
 #include "compare.h"
 #include "compute.h"
@@ -19,10 +22,10 @@ int evaluateShoeColor(ShoeColor shoecolor) {
     // Compare shoe color with shoes in database
     // If shoe color is within a certain threshold, return the shoe id
     // Else return -1
-    std::vector<int> shoeIds = getShoeImagesWithSimilarColor(shoecolor);
+    std::vector<std::pair<int, float>> closestShoes = getShoeColorGrid().nearest(shoecolor, 5);
     std::cout << "Shoe IDs with similar color: ";
-    for (int i = 0; i < shoeIds.size(); i++) {
-        std::cout << shoeIds[i] << " ";
+    for (int i = 0; i < closestShoes.size(); i++) {
+        std::cout << closestShoes[i].first << " ";
     }
     return 1;
 }
@@ -41,4 +44,183 @@ std::vector<int> evaluateShoeDominantColors(std::vector<DominantColor> dominantC
     return shoeImageIds;
 }
 
+// Ids of the k shoes most similar to a stored shoe, without the shoe itself
+std::vector<int> rankSimilarShoes(const FeatureMatrix& features, const FeatureQuery& query, int queryShoeImageId, int k) {
+    std::vector<int> ranking;
+    for (const auto& [shoeImageId, score] : findMostSimilarShoes(features, query, k + 1)) {
+        if (shoeImageId != queryShoeImageId && (int)ranking.size() < k) {
+            ranking.push_back(shoeImageId);
+        }
+    }
+    return ranking;
+}
+
+// Share of the reference ranking that is found in the ranking
+double recallOfRanking(const std::vector<int>& reference, const std::vector<int>& ranking) {
+    if (reference.empty()) {
+        return 1.0;
+    }
+    int found = 0;
+    for (int shoeImageId : reference) {
+        found += std::find(ranking.begin(), ranking.end(), shoeImageId) != ranking.end();
+    }
+    return (double)found / reference.size();
+}
+
+// Cost and quality of one descriptor profile measured on a sample of the catalogue
+struct DescriptorProfileBenchmark {
+    std::string profile;
+    int rgbBins;
+    int lbpBins;
+    // Size of the RGB, LBP and HOG features of one shoe
+    size_t bytesPerShoe;
+    // Average feature extraction time per image, after segmentation
+    double extractionMilliseconds;
+    // Average time to rank the whole sample for one query
+    double scoringMicroseconds;
+    // Average share of the k most similar shoes of the default profile that this profile finds too
+    double recallAtK;
+};
+
+// Compare every descriptor profile against the default one: each sample shoe is used as a query
+// against the rest of the sample, and the top k of each profile is compared with the top k of
+// the default profile. There are no ground truth labels, so the default profile is the reference.
+std::vector<DescriptorProfileBenchmark> benchmarkDescriptorProfiles(const std::vector<int>& shoeImageIds, int k = 5) {
+    using Clock = std::chrono::steady_clock;
+
+    std::vector<int> sampleIds;
+    std::vector<SegmentedShoe> segmentedShoes;
+    for (int shoeImageId : shoeImageIds) {
+        try {
+            segmentedShoes.push_back(segmentShoe(getShoeImageByID(shoeImageId)));
+            sampleIds.push_back(shoeImageId);
+        } catch (const std::exception &e) {
+            std::cerr << "Skipping shoe image " << shoeImageId << ": " << e.what() << std::endl;
+        }
+    }
+
+    std::vector<DescriptorProfileBenchmark> benchmarks;
+    std::vector<std::vector<int>> referenceRankings;
+    for (const DescriptorProfile& profile : getDescriptorProfiles()) {
+        DescriptorProfileBenchmark benchmark;
+        benchmark.profile = profile.name;
+        benchmark.rgbBins = profile.rgbBins;
+        benchmark.lbpBins = profile.lbpBins();
+
+        Clock::time_point extractionStart = Clock::now();
+        std::vector<ShoeProperties> sampleProperties;
+        for (const SegmentedShoe& segmentedShoe : segmentedShoes) {
+            FeatureExtractionPipeline pipeline(segmentedShoe);
+            sampleProperties.push_back(pipeline.computeShoeFeatures(profile));
+        }
+        double extractionMilliseconds = std::chrono::duration<double, std::milli>(Clock::now() - extractionStart).count();
+
+        FeatureLayout layout(profile.rgbBins, profile.lbpBins());
+        benchmark.bytesPerShoe = (3 * layout.sizes[RedSegment] + layout.sizes[LBPSegment] + layout.sizes[HOGSegment]) * sizeof(float);
+
+        FeatureMatrix features(layout);
+        for (size_t i = 0; i < sampleProperties.size(); i++) {
+            features.append(sampleIds[i], sampleProperties[i]);
+        }
+
+        double scoringMicroseconds = 0.0;
+        double recall = 0.0;
+        std::vector<std::vector<int>> rankings;
+        for (size_t i = 0; i < sampleProperties.size(); i++) {
+            Clock::time_point scoringStart = Clock::now();
+            FeatureQuery query(layout, sampleProperties[i]);
+            std::vector<int> ranking = rankSimilarShoes(features, query, sampleIds[i], k);
+            scoringMicroseconds += std::chrono::duration<double, std::micro>(Clock::now() - scoringStart).count();
+
+            if (!referenceRankings.empty()) {
+                recall += recallOfRanking(referenceRankings[i], ranking);
+            }
+            rankings.push_back(ranking);
+        }
+
+        size_t nrOfQueries = std::max<size_t>(1, sampleProperties.size());
+        benchmark.extractionMilliseconds = extractionMilliseconds / nrOfQueries;
+        benchmark.scoringMicroseconds = scoringMicroseconds / nrOfQueries;
+        benchmark.recallAtK = referenceRankings.empty() ? 1.0 : recall / nrOfQueries;
+        if (referenceRankings.empty()) {
+            // The default profile is the first one and the reference for the others
+            referenceRankings = rankings;
+        }
+        benchmarks.push_back(benchmark);
+    }
+
+    return benchmarks;
+}
+
+// Ranking impact of scoring PCA reduced HOG features instead of the raw ones
+struct HOGProjectionRecall {
+    std::string projection;
+    int dimension;
+    double retainedVariance;
+    size_t rawBytesPerShoe;
+    size_t projectedBytesPerShoe;
+    int nrOfQueries;
+    // Average time to rank the whole catalogue for one query
+    double rawScoringMicroseconds;
+    double projectedScoringMicroseconds;
+    // Average share of the raw top k found in the projected top k, with the full score and with HOG alone
+    double recallAtK;
+    double hogRecallAtK;
+};
+
+// Rank the catalogue with raw and with projected HOG features for evenly spread stored shoes,
+// the raw ranking is the reference
+HOGProjectionRecall reportHOGProjectionRecall(const HOGProjection& hogProjection, int nrOfQueries = 100, int k = 10) {
+    using Clock = std::chrono::steady_clock;
+
+    FeatureMatrix rawFeatures = loadFeatureMatrix();
+    FeatureMatrix projectedFeatures = loadFeatureMatrix({}, &hogProjection);
+
+    std::vector<int> queryShoeImageIds;
+    size_t step = std::max<size_t>(1, rawFeatures.rows() / std::max(1, nrOfQueries));
+    for (size_t row = 0; row < rawFeatures.rows() && (int)queryShoeImageIds.size() < nrOfQueries; row += step) {
+        queryShoeImageIds.push_back(rawFeatures.shoeImageIds[row]);
+    }
+    ShoePropertiesList queryProperties = getShoeProperties(queryShoeImageIds);
+
+    HOGProjectionRecall report;
+    report.projection = hogProjection.name();
+    report.dimension = hogProjection.dimension();
+    report.retainedVariance = hogProjection.retainedVariance;
+    report.rawBytesPerShoe = rawFeatures.layout.rowStride * sizeof(float);
+    report.projectedBytesPerShoe = projectedFeatures.layout.rowStride * sizeof(float);
+    report.nrOfQueries = (int)queryProperties.shoeImageIds.size();
+
+    const ScoreWeights hogOnly{0.0, 0.0, 1.0};
+    double rawScoringMicroseconds = 0.0;
+    double projectedScoringMicroseconds = 0.0;
+    double recall = 0.0;
+    double hogRecall = 0.0;
+    for (size_t i = 0; i < queryProperties.shoeImageIds.size(); i++) {
+        int queryShoeImageId = queryProperties.shoeImageIds[i];
+        ShoeProperties rawProperties{queryProperties.RGBHistograms[i], queryProperties.LBPHistograms[i], queryProperties.HOGFeatures[i]};
+        ShoeProperties projectedProperties = projectShoeProperties(rawProperties, &hogProjection);
+
+        Clock::time_point rawStart = Clock::now();
+        std::vector<int> rawRanking = rankSimilarShoes(rawFeatures, FeatureQuery(rawFeatures.layout, rawProperties), queryShoeImageId, k);
+        rawScoringMicroseconds += std::chrono::duration<double, std::micro>(Clock::now() - rawStart).count();
+
+        Clock::time_point projectedStart = Clock::now();
+        std::vector<int> projectedRanking = rankSimilarShoes(projectedFeatures, FeatureQuery(projectedFeatures.layout, projectedProperties), queryShoeImageId, k);
+        projectedScoringMicroseconds += std::chrono::duration<double, std::micro>(Clock::now() - projectedStart).count();
+
+        recall += recallOfRanking(rawRanking, projectedRanking);
+        hogRecall += recallOfRanking(
+            rankSimilarShoes(rawFeatures, FeatureQuery(rawFeatures.layout, rawProperties, hogOnly), queryShoeImageId, k),
+            rankSimilarShoes(projectedFeatures, FeatureQuery(projectedFeatures.layout, projectedProperties, hogOnly), queryShoeImageId, k));
+    }
+
+    int nrOfRankedQueries = std::max(1, report.nrOfQueries);
+    report.rawScoringMicroseconds = rawScoringMicroseconds / nrOfRankedQueries;
+    report.projectedScoringMicroseconds = projectedScoringMicroseconds / nrOfRankedQueries;
+    report.recallAtK = recall / nrOfRankedQueries;
+    report.hogRecallAtK = hogRecall / nrOfRankedQueries;
+    return report;
+}
+
 #endif
\ No newline at end of file
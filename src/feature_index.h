@@ -0,0 +1,280 @@
+#ifndef FEATURE_INDEX_H
+#define FEATURE_INDEX_H
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include "compute.h"
+#include "database_features.h"
+#include "feature_matrix.h"
+#include "hnsw_index.h"
+#include "hog_projection.h"
+#include "ivfpq_index.h"
+
+// Everything the index holds, handed as a whole to read-only queries
+struct IndexedShoeFeatures {
+    FeatureMatrix matrix;
+    std::unordered_map<int, size_t> rowByShoeImageId;
+    // Optional approximate nearest neighbour graph over the HOG segment of the matrix rows
+    std::unique_ptr<HNSWIndex> hogGraph;
+    // Optional compressed index, it can also cover shoes whose full features are not resident
+    std::unique_ptr<IVFPQIndex> ivfpq;
+    // Optional PCA projection, the HOG segment of the rows then holds the reduced HOG features
+    std::shared_ptr<const HOGProjection> hogProjection;
+    // Only the IVF-PQ ids and codes are resident, the matrix has no rows and every candidate is
+    // re-ranked from its full precision features fetched by id
+    bool codesOnly = false;
+};
+
+// Layout of the packed rows, with the HOG segment reduced to the dimension of the projection if there is one
+FeatureLayout featureLayoutFor(const HOGProjection* hogProjection) {
+    FeatureLayout layout;
+    if (hogProjection != nullptr) {
+        layout = FeatureLayout(layout.sizes[RedSegment], layout.sizes[LBPSegment], hogProjection->dimension());
+    }
+    return layout;
+}
+
+// Replace the HOG features by their projection, so they match the rows of a projected feature matrix
+ShoeProperties projectShoeProperties(const ShoeProperties& shoeProperties, const HOGProjection* hogProjection) {
+    if (hogProjection == nullptr) {
+        return shoeProperties;
+    }
+    return ShoeProperties{shoeProperties.rgbHistograms, shoeProperties.lbpHistogram, hogProjection->project(shoeProperties.hogFeatures)};
+}
+
+static_assert((int)RedHistogramPayload == RedSegment && (int)LBPHistogramPayload == LBPSegment && (int)HOGPayload == HOGSegment,
+    "Feature record payloads are read into the feature segment of the same index");
+
+// Load the features stored in the database into a packed feature matrix.
+// The feature records are streamed from the database and every payload is checked against the layout
+// and copied straight into its segment of the preallocated matrix, so loading needs no second copy of the catalogue.
+// Shoes without a feature record are not loaded, backfill their records from the separate feature tables first.
+// With a HOG projection the reduced HOG features stored for it are used, shoes without them are projected while loading.
+FeatureMatrix loadFeatureMatrix(const std::vector<int>& shoeImageIds = {}, const HOGProjection* hogProjection = nullptr) {
+    const int rawHOGSize = FeatureLayout().sizes[HOGSegment];
+    FeatureLayout layout = featureLayoutFor(hogProjection);
+    std::unordered_map<int, cv::Mat> projectedHOGFeatures;
+    if (hogProjection != nullptr) {
+        // Projecting a handful of shoes is cheaper than fetching every stored projection
+        if (shoeImageIds.empty()) {
+            projectedHOGFeatures = getProjectedHOGFeatures(hogProjection->name());
+        }
+    }
+
+    FeatureMatrix features(layout);
+    features.reserve(countFeatureRecords(shoeImageIds));
+
+    // Raw HOG features that still have to be projected are read here first
+    cv::Mat rawHOGFeatures(1, rawHOGSize, CV_32F);
+    streamFeatureRecords([&](int shoeImageId, const FeatureRecordView& record) {
+        // Copy one payload into place, it has to hold exactly nrOfFloats floats
+        auto readSegment = [&](int segment, float* destination, int nrOfFloats) {
+            cv::Mat payload = record.payload((FeatureRecordPayload)segment, CV_32F, nrOfFloats);
+            std::copy_n(payload.ptr<float>(), nrOfFloats, destination);
+        };
+
+        size_t index = features.appendRow(shoeImageId);
+        try {
+            float* row = features.row(index);
+            for (int segment = RedSegment; segment < HOGSegment; segment++) {
+                readSegment(segment, row + layout.offsets[segment], layout.sizes[segment]);
+            }
+
+            float* hogSegment = row + layout.offsets[HOGSegment];
+            if (hogProjection == nullptr) {
+                readSegment(HOGSegment, hogSegment, rawHOGSize);
+            } else {
+                auto projectedHOG = projectedHOGFeatures.find(shoeImageId);
+                if (projectedHOG != projectedHOGFeatures.end() && (int)projectedHOG->second.total() == hogProjection->dimension()) {
+                    std::copy_n(projectedHOG->second.ptr<float>(), hogProjection->dimension(), hogSegment);
+                } else {
+                    readSegment(HOGSegment, rawHOGFeatures.ptr<float>(), rawHOGSize);
+                    cv::Mat projected = hogProjection->project(rawHOGFeatures);
+                    std::copy_n(projected.ptr<float>(), hogProjection->dimension(), hogSegment);
+                }
+            }
+
+            features.finishRow(index);
+        } catch (const std::exception &e) {
+            features.popRow();
+            std::cerr << "Skipping shoe image " << shoeImageId << ": " << e.what() << std::endl;
+        }
+    }, shoeImageIds);
+    return features;
+}
+
+// Process-wide, resident copy of the features stored in the feature records.
+// It is loaded once at startup and kept up to date by the save routes, so requests
+// only pay for feature extraction and scoring instead of reloading every row.
+struct ShoeFeatureIndex {
+    // Build and maintain a HNSW graph over the HOG features from the next load on
+    void enableHOGGraph(HNSWParameters parameters = HNSWParameters()) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        hogGraphParameters = std::make_unique<HNSWParameters>(parameters);
+    }
+
+    // Score reduced HOG features from the next load on, nullptr goes back to the raw HOG features
+    void setHOGProjection(std::shared_ptr<const HOGProjection> projection) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        hogProjection = std::move(projection);
+    }
+
+    std::shared_ptr<const HOGProjection> getHOGProjection() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return hogProjection;
+    }
+
+    // Keep only the IVF-PQ ids and codes resident from the next load on, instead of the full feature
+    // matrix. It takes effect once an IVF-PQ index matching the feature layout is set.
+    void setCodesOnly(bool enabled) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        codesOnly = enabled;
+    }
+
+    // Replace the index content with the current content of the database.
+    // A loaded IVF-PQ index is kept, it is persisted and trained separately.
+    void load() {
+        IndexedShoeFeatures loadedFeatures;
+        loadedFeatures.hogProjection = getHOGProjection();
+        FeatureLayout layout = featureLayoutFor(loadedFeatures.hogProjection.get());
+        loadedFeatures.codesOnly = canKeepCodesOnly(layout);
+        if (loadedFeatures.codesOnly) {
+            // The full precision rows stay in the database, the empty matrix only carries the layout
+            loadedFeatures.matrix = FeatureMatrix(layout);
+        } else {
+            loadedFeatures.matrix = loadFeatureMatrix({}, loadedFeatures.hogProjection.get());
+        }
+        for (size_t row = 0; row < loadedFeatures.matrix.rows(); row++) {
+            loadedFeatures.rowByShoeImageId[loadedFeatures.matrix.shoeImageIds[row]] = row;
+        }
+
+        std::unique_ptr<HNSWParameters> graphParameters = getHOGGraphParameters();
+        if (graphParameters && !loadedFeatures.codesOnly) {
+            loadedFeatures.hogGraph = std::make_unique<HNSWIndex>(*graphParameters, HOGSegment);
+            for (size_t row = 0; row < loadedFeatures.matrix.rows(); row++) {
+                loadedFeatures.hogGraph->insert(loadedFeatures.matrix, row);
+            }
+        }
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        loadedFeatures.ivfpq = std::move(features.ivfpq);
+        features = std::move(loadedFeatures);
+    }
+
+    // Replace the compressed index, shoes added afterwards are encoded into it as well
+    void setIVFPQIndex(std::unique_ptr<IVFPQIndex> ivfpq) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        features.ivfpq = std::move(ivfpq);
+    }
+
+    // Add the features of a newly saved shoe image, or replace them if the id is already indexed
+    void add(int shoeImageId, const ShoeProperties& rawShoeProperties) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        ShoeProperties shoeProperties = projectShoeProperties(rawShoeProperties, features.hogProjection.get());
+
+        if (features.codesOnly) {
+            // The row is only packed to be encoded, a re-saved shoe keeps its old code as well
+            FeatureMatrix packedRow(features.matrix.layout);
+            packedRow.append(shoeImageId, shoeProperties);
+            features.ivfpq->add(shoeImageId, packedRow.row(0));
+            return;
+        }
+
+        auto existingRow = features.rowByShoeImageId.find(shoeImageId);
+        if (existingRow != features.rowByShoeImageId.end()) {
+            // The approximate indexes keep the old features, their candidates are rescored exactly anyway
+            features.matrix.set(existingRow->second, shoeProperties);
+            return;
+        }
+
+        size_t row = features.matrix.append(shoeImageId, shoeProperties);
+        features.rowByShoeImageId[shoeImageId] = row;
+        if (features.hogGraph) {
+            features.hogGraph->insert(features.matrix, row);
+        }
+        if (features.ivfpq && features.ivfpq->isTrained() && features.ivfpq->layout == features.matrix.layout) {
+            features.ivfpq->add(shoeImageId, features.matrix.row(row));
+        }
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return features.codesOnly ? features.ivfpq->size() : features.matrix.rows();
+    }
+
+    // Run a read-only query against the indexed features while holding a shared lock,
+    // so concurrent requests can score in parallel while saves wait for them
+    template <typename Query>
+    auto query(Query&& runQuery) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return runQuery(features);
+    }
+
+private:
+    bool canKeepCodesOnly(const FeatureLayout& layout) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return codesOnly && features.ivfpq && features.ivfpq->isTrained() && features.ivfpq->layout == layout;
+    }
+
+    std::unique_ptr<HNSWParameters> getHOGGraphParameters() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return hogGraphParameters ? std::make_unique<HNSWParameters>(*hogGraphParameters) : nullptr;
+    }
+
+    mutable std::shared_mutex mutex;
+    IndexedShoeFeatures features;
+    std::unique_ptr<HNSWParameters> hogGraphParameters;
+    std::shared_ptr<const HOGProjection> hogProjection;
+    bool codesOnly = false;
+};
+
+// Train an IVF-PQ index on the features stored in the database and encode all of them.
+// Pass the HOG projection of the feature index so the compressed rows match its layout.
+std::unique_ptr<IVFPQIndex> trainIVFPQIndex(IVFPQParameters parameters = IVFPQParameters(), const HOGProjection* hogProjection = nullptr) {
+    FeatureMatrix features = loadFeatureMatrix({}, hogProjection);
+
+    auto ivfpq = std::make_unique<IVFPQIndex>();
+    ivfpq->train(features, parameters);
+    ivfpq->addAll(features);
+    return ivfpq;
+}
+
+// Fit a PCA projection on the stored HOG features and store the reduced HOG features of every shoe
+std::shared_ptr<HOGProjection> trainHOGProjection(HOGProjectionParameters parameters = HOGProjectionParameters()) {
+    // One descriptor per row, streamed straight into the preallocated rows
+    const int hogSize = FeatureLayout().sizes[HOGSegment];
+    cv::Mat descriptors((int)countFeatureRecords(), hogSize, CV_32F);
+    std::vector<int> shoeImageIds;
+    streamFeatureRecords([&](int shoeImageId, const FeatureRecordView& record) {
+        if ((int)shoeImageIds.size() == descriptors.rows) {
+            descriptors.resize(descriptors.rows * 2 + 1);
+        }
+        try {
+            cv::Mat hogFeatures = record.payload(HOGPayload, CV_32F, hogSize);
+            std::copy_n(hogFeatures.ptr<float>(), hogSize, descriptors.ptr<float>((int)shoeImageIds.size()));
+            shoeImageIds.push_back(shoeImageId);
+        } catch (const std::exception &e) {
+            std::cerr << "Skipping shoe image " << shoeImageId << ": " << e.what() << std::endl;
+        }
+    });
+    descriptors = descriptors.rowRange(0, (int)shoeImageIds.size());
+
+    auto hogProjection = std::make_shared<HOGProjection>();
+    hogProjection->train(descriptors, parameters);
+
+    ensureProjectedHOGTable();
+    saveProjectedHOGFeatures(shoeImageIds, hogProjection->project(descriptors), hogProjection->name());
+    return hogProjection;
+}
+
+// Single index shared by all request threads
+ShoeFeatureIndex& getShoeFeatureIndex() {
+    static ShoeFeatureIndex shoeFeatureIndex;
+    return shoeFeatureIndex;
+}
+
+#endif // FEATURE_INDEX_H
@@ -0,0 +1,377 @@
+#ifndef FEATURE_MATRIX_H
+#define FEATURE_MATRIX_H
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "compute.h"
+
+// Rows and segments are aligned to a cache line so that every segment can be streamed with aligned vector loads
+constexpr size_t featureAlignment = 64;
+constexpr int floatsPerAlignment = featureAlignment / sizeof(float);
+
+int alignFloatCount(int count) {
+    return (count + floatsPerAlignment - 1) / floatsPerAlignment * floatsPerAlignment;
+}
+
+struct AlignedFloatDeleter {
+    void operator()(float* values) const { std::free(values); }
+};
+using AlignedFloatBuffer = std::unique_ptr<float[], AlignedFloatDeleter>;
+
+// Allocate a zero filled, cache line aligned float buffer
+AlignedFloatBuffer allocateAlignedFloats(size_t count) {
+    size_t bytes = (count * sizeof(float) + featureAlignment - 1) / featureAlignment * featureAlignment;
+    float* values = static_cast<float*>(std::aligned_alloc(featureAlignment, std::max(bytes, featureAlignment)));
+    if (values == nullptr) {
+        throw std::bad_alloc();
+    }
+    std::memset(values, 0, std::max(bytes, featureAlignment));
+    return AlignedFloatBuffer(values);
+}
+
+// Segments of a packed feature row, in storage order
+enum FeatureSegment {
+    RedSegment,
+    GreenSegment,
+    BlueSegment,
+    LBPSegment,
+    HOGSegment,
+    NrOfFeatureSegments
+};
+
+// Sizes and offsets of the segments inside a packed feature row.
+// Every segment starts on a cache line, the padding between segments stays zero.
+struct FeatureLayout {
+    int sizes[NrOfFeatureSegments];
+    int offsets[NrOfFeatureSegments];
+    int rowStride;
+
+    FeatureLayout(int rgbBins = 256, int lbpBins = 256, int hogSize = 3780) {
+        sizes[RedSegment] = rgbBins;
+        sizes[GreenSegment] = rgbBins;
+        sizes[BlueSegment] = rgbBins;
+        sizes[LBPSegment] = lbpBins;
+        sizes[HOGSegment] = hogSize;
+
+        int offset = 0;
+        for (int segment = 0; segment < NrOfFeatureSegments; segment++) {
+            offsets[segment] = offset;
+            offset += alignFloatCount(sizes[segment]);
+        }
+        rowStride = offset;
+    }
+
+    bool operator==(const FeatureLayout& other) const {
+        return std::equal(sizes, sizes + NrOfFeatureSegments, other.sizes);
+    }
+    bool operator!=(const FeatureLayout& other) const { return !(*this == other); }
+};
+
+// Copy a feature Mat into its segment of a packed row, checking that it has the expected shape
+void packFeatureSegment(float* row, const FeatureLayout& layout, FeatureSegment segment, const cv::Mat& feature) {
+    if (feature.type() != CV_32F || (int)feature.total() != layout.sizes[segment]) {
+        throw std::runtime_error(
+            "Feature segment " + std::to_string(segment) + " has " + std::to_string(feature.total()) +
+            " values of type " + std::to_string(feature.type()) + ", expected " + std::to_string(layout.sizes[segment]) + " floats"
+        );
+    }
+
+    cv::Mat continuousFeature = feature.isContinuous() ? feature : feature.clone();
+    std::memcpy(row + layout.offsets[segment], continuousFeature.ptr<float>(), layout.sizes[segment] * sizeof(float));
+}
+
+void packShoeProperties(float* row, const FeatureLayout& layout, const ShoeProperties& shoeProperties) {
+    if (shoeProperties.rgbHistograms.size() != 3) {
+        throw std::runtime_error("Expected 3 RGB histograms, got " + std::to_string(shoeProperties.rgbHistograms.size()));
+    }
+    packFeatureSegment(row, layout, RedSegment, shoeProperties.rgbHistograms[0]);
+    packFeatureSegment(row, layout, GreenSegment, shoeProperties.rgbHistograms[1]);
+    packFeatureSegment(row, layout, BlueSegment, shoeProperties.rgbHistograms[2]);
+    packFeatureSegment(row, layout, LBPSegment, shoeProperties.lbpHistogram);
+    packFeatureSegment(row, layout, HOGSegment, shoeProperties.hogFeatures);
+}
+
+// Mean-centre and L2-normalize a vector in place, returning the removed mean and norm.
+// The Pearson correlation of two normalized vectors is their dot product.
+void normalizeFeatureValues(float* values, int size, float& mean, float& norm) {
+    double sum = 0.0;
+    for (int i = 0; i < size; i++) {
+        sum += values[i];
+    }
+    double valuesMean = sum / size;
+
+    double squaredSum = 0.0;
+    for (int i = 0; i < size; i++) {
+        double centredValue = values[i] - valuesMean;
+        squaredSum += centredValue * centredValue;
+    }
+    double valuesNorm = std::sqrt(squaredSum);
+
+    // A constant vector carries no information, it is stored as zeros and correlates 0 with anything
+    double scale = valuesNorm > DBL_EPSILON ? 1.0 / valuesNorm : 0.0;
+    for (int i = 0; i < size; i++) {
+        values[i] = (float)((values[i] - valuesMean) * scale);
+    }
+
+    mean = (float)valuesMean;
+    norm = (float)valuesNorm;
+}
+
+// Normalize every segment of a packed row in place, returning the removed mean and norm of each
+// segment, so the correlation statistics are computed once per shoe instead of once per comparison
+void normalizeFeatureRow(float* row, const FeatureLayout& layout, float* means, float* norms) {
+    for (int segment = 0; segment < NrOfFeatureSegments; segment++) {
+        normalizeFeatureValues(row + layout.offsets[segment], layout.sizes[segment], means[segment], norms[segment]);
+    }
+}
+
+// Coarse colour signature of a shoe: its RGB histograms summed into 16 bins per channel and
+// normalized per channel. Correlating it costs 48 multiplications instead of 768, which makes
+// it a cheap first filter over the whole catalogue.
+constexpr int colorSignatureBins = 16;
+constexpr int colorSignatureSize = 3 * colorSignatureBins;
+
+// Compute the colour signature from the RGB segments of a packed row that is not normalized yet
+void computeColorSignature(const float* packedRow, const FeatureLayout& layout, float* signature) {
+    const int rgbBins = layout.sizes[RedSegment];
+    for (int channel = 0; channel < 3; channel++) {
+        const float* histogram = packedRow + layout.offsets[RedSegment + channel];
+        float* channelSignature = signature + channel * colorSignatureBins;
+        for (int bin = 0; bin < colorSignatureBins; bin++) {
+            int begin = bin * rgbBins / colorSignatureBins;
+            int end = (bin + 1) * rgbBins / colorSignatureBins;
+            channelSignature[bin] = std::accumulate(histogram + begin, histogram + end, 0.0f);
+        }
+
+        float mean, norm;
+        normalizeFeatureValues(channelSignature, colorSignatureBins, mean, norm);
+    }
+}
+
+// Contiguous, row-major store of the features of all shoes: one cache line aligned row per shoe.
+// Replaces five separately allocated cv::Mat per shoe so a full scan streams linearly through memory.
+// Rows are stored normalized (see normalizeFeatureRow), the removed mean and norm of every
+// segment are kept alongside in segmentMeans and segmentNorms. The colour signatures of all
+// rows are kept in a separate contiguous buffer, so the colour filter streams only through them.
+struct FeatureMatrix {
+    FeatureLayout layout;
+    std::vector<int> shoeImageIds;
+    std::vector<float> segmentMeans;
+    std::vector<float> segmentNorms;
+
+    explicit FeatureMatrix(FeatureLayout layout = FeatureLayout()) : layout(layout) {}
+
+    size_t rows() const { return shoeImageIds.size(); }
+
+    float* row(size_t index) { return data.get() + index * layout.rowStride; }
+    const float* row(size_t index) const { return data.get() + index * layout.rowStride; }
+
+    const float* colorSignature(size_t index) const { return colorSignatures.get() + index * colorSignatureSize; }
+
+    void reserve(size_t rowCapacity) {
+        if (rowCapacity <= capacity) {
+            return;
+        }
+
+        AlignedFloatBuffer grownData = allocateAlignedFloats(rowCapacity * layout.rowStride);
+        AlignedFloatBuffer grownColorSignatures = allocateAlignedFloats(rowCapacity * colorSignatureSize);
+        if (data) {
+            std::memcpy(grownData.get(), data.get(), rows() * layout.rowStride * sizeof(float));
+            std::memcpy(grownColorSignatures.get(), colorSignatures.get(), rows() * colorSignatureSize * sizeof(float));
+        }
+        data = std::move(grownData);
+        colorSignatures = std::move(grownColorSignatures);
+        capacity = rowCapacity;
+    }
+
+    // Append an empty row and return its index
+    size_t appendRow(int shoeImageId) {
+        if (rows() == capacity) {
+            reserve(std::max<size_t>(64, capacity * 2));
+        }
+        shoeImageIds.push_back(shoeImageId);
+        segmentMeans.resize(rows() * NrOfFeatureSegments, 0.0f);
+        segmentNorms.resize(rows() * NrOfFeatureSegments, 0.0f);
+        return rows() - 1;
+    }
+
+    // Remove the last row, e.g. when filling it in place failed. The row is zeroed so its padding stays zero.
+    void popRow() {
+        std::memset(row(rows() - 1), 0, layout.rowStride * sizeof(float));
+        shoeImageIds.pop_back();
+        segmentMeans.resize(rows() * NrOfFeatureSegments);
+        segmentNorms.resize(rows() * NrOfFeatureSegments);
+    }
+
+    // Compute the colour signature of a row whose segments were written in place, then normalize it
+    void finishRow(size_t index) {
+        computeColorSignature(row(index), layout, colorSignatures.get() + index * colorSignatureSize);
+        normalizeFeatureRow(
+            row(index),
+            layout,
+            &segmentMeans[index * NrOfFeatureSegments],
+            &segmentNorms[index * NrOfFeatureSegments]
+        );
+    }
+
+    // Pack and normalize the features of a shoe into an existing row.
+    // The row is left untouched if the features don't match the layout.
+    void set(size_t index, const ShoeProperties& shoeProperties) {
+        AlignedFloatBuffer packedRow = allocateAlignedFloats(layout.rowStride);
+        packShoeProperties(packedRow.get(), layout, shoeProperties);
+        computeColorSignature(packedRow.get(), layout, colorSignatures.get() + index * colorSignatureSize);
+        normalizeFeatureRow(
+            packedRow.get(),
+            layout,
+            &segmentMeans[index * NrOfFeatureSegments],
+            &segmentNorms[index * NrOfFeatureSegments]
+        );
+        std::memcpy(row(index), packedRow.get(), layout.rowStride * sizeof(float));
+    }
+
+    size_t append(int shoeImageId, const ShoeProperties& shoeProperties) {
+        size_t index = appendRow(shoeImageId);
+        try {
+            set(index, shoeProperties);
+        } catch (...) {
+            popRow();
+            throw;
+        }
+        return index;
+    }
+
+    // View of the whole matrix as a cv::Mat, without copying
+    cv::Mat asMat() const {
+        return cv::Mat((int)rows(), layout.rowStride, CV_32F, (void*)data.get(), layout.rowStride * sizeof(float));
+    }
+
+private:
+    AlignedFloatBuffer data;
+    AlignedFloatBuffer colorSignatures;
+    size_t capacity = 0;
+};
+
+// Weights of the features in the total similarity score
+struct ScoreWeights {
+    double rgb = 0.3;
+    double lbp = 0.3;
+    double hog = 0.4;
+};
+
+// Weight of a single segment, the colour weight is shared by the three channels
+double segmentWeight(const ScoreWeights& weights, int segment) {
+    switch (segment) {
+        case RedSegment:
+        case GreenSegment:
+        case BlueSegment:
+            return weights.rgb / 3;
+        case LBPSegment:
+            return weights.lbp;
+        default:
+            return weights.hog;
+    }
+}
+
+// Query features packed and normalized like the matrix rows. The weighted copy has every
+// segment scaled by its weight, so the total score against a row is a single dot product.
+struct FeatureQuery {
+    FeatureLayout layout;
+    AlignedFloatBuffer values;
+    AlignedFloatBuffer weightedValues;
+    AlignedFloatBuffer colorSignature;
+
+    FeatureQuery(const FeatureLayout& layout, const ShoeProperties& shoeProperties, const ScoreWeights& weights = ScoreWeights())
+        : layout(layout),
+          values(allocateAlignedFloats(layout.rowStride)),
+          weightedValues(allocateAlignedFloats(layout.rowStride)),
+          colorSignature(allocateAlignedFloats(colorSignatureSize)) {
+        float means[NrOfFeatureSegments];
+        float norms[NrOfFeatureSegments];
+        packShoeProperties(values.get(), layout, shoeProperties);
+        computeColorSignature(values.get(), layout, colorSignature.get());
+        normalizeFeatureRow(values.get(), layout, means, norms);
+
+        for (int segment = 0; segment < NrOfFeatureSegments; segment++) {
+            const float weight = (float)segmentWeight(weights, segment);
+            for (int i = layout.offsets[segment]; i < layout.offsets[segment] + layout.sizes[segment]; i++) {
+                weightedValues[i] = weight * values[i];
+            }
+        }
+    }
+
+    // The weighted query as a 1 x rowStride cv::Mat, without copying
+    cv::Mat weightedMat() const {
+        return cv::Mat(1, layout.rowStride, CV_32F, (void*)weightedValues.get());
+    }
+};
+
+float dotProduct(const float* first, const float* second, int size) {
+    float sum = 0.0f;
+#pragma omp simd aligned(first, second : 64) reduction(+ : sum)
+    for (int i = 0; i < size; i++) {
+        sum += first[i] * second[i];
+    }
+    return sum;
+}
+
+// Correlation of one query segment against the same segment of a stored row.
+// Both are normalized, so this is the value of cv::compareHist(..., cv::HISTCMP_CORREL) as a dot product.
+double correlateFeatureSegment(const float* row, const FeatureQuery& query, int segment) {
+    const int offset = query.layout.offsets[segment];
+    return dotProduct(row + offset, query.values.get() + offset, query.layout.sizes[segment]);
+}
+
+// Mean correlation of the query and row colour signatures over the three channels
+double correlateColorSignature(const FeatureMatrix& features, size_t row, const FeatureQuery& query) {
+    return dotProduct(features.colorSignature(row), query.colorSignature.get(), colorSignatureSize) / 3;
+}
+
+// Weighted similarity of the query against one stored row
+double scoreFeatureRow(const float* row, const FeatureQuery& query) {
+    return dotProduct(row, query.weightedValues.get(), query.layout.rowStride);
+}
+
+// Score the query against the rows [begin, end) as one matrix-vector product, writing end - begin scores
+void scoreFeatureRows(const FeatureMatrix& features, const FeatureQuery& query, size_t begin, size_t end, float* scores) {
+    if (end <= begin) {
+        return;
+    }
+
+    cv::Mat scoreMat((int)(end - begin), 1, CV_32F, scores);
+    cv::gemm(features.asMat().rowRange((int)begin, (int)end), query.weightedMat(), 1.0, cv::noArray(), 0.0, scoreMat, cv::GEMM_2_T);
+}
+
+// Score the query against every row of the matrix
+std::vector<float> scoreFeatureMatrix(const FeatureMatrix& features, const FeatureQuery& query) {
+    std::vector<float> scores(features.rows());
+    scoreFeatureRows(features, query, 0, features.rows(), scores.data());
+    return scores;
+}
+
+// Score several queries at once as one matrix-matrix product.
+// Returns a rows x queries matrix, column j holding the scores of queries[j].
+cv::Mat scoreFeatureMatrix(const FeatureMatrix& features, const std::vector<FeatureQuery>& queries) {
+    cv::Mat scores;
+    if (features.rows() == 0 || queries.empty()) {
+        return cv::Mat::zeros((int)features.rows(), (int)queries.size(), CV_32F);
+    }
+
+    cv::Mat weightedQueries((int)queries.size(), features.layout.rowStride, CV_32F);
+    for (size_t i = 0; i < queries.size(); i++) {
+        queries[i].weightedMat().copyTo(weightedQueries.row((int)i));
+    }
+    cv::gemm(features.asMat(), weightedQueries, 1.0, cv::noArray(), 0.0, scores, cv::GEMM_2_T);
+    return scores;
+}
+
+#endif // FEATURE_MATRIX_H
@@ -0,0 +1,220 @@
+#ifndef FEATURE_RECORD_H
+#define FEATURE_RECORD_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "compute.h"
+
+// Serialized features of one shoe, stored in a single column.
+// A record is a fixed header, a table with one entry per payload and the payloads themselves:
+//   header         magic "SHFR", format version, payload count, record size, CRC-32 of the payloads, descriptor profile
+//   payload table  OpenCV depth, channels, rows, columns, offset and size of every payload
+//   payloads       raw Mat data, every payload starting at a multiple of featureRecordAlignment
+// Integers are in host byte order, which is little endian on every platform the service runs on.
+// Changing any of this is a new featureRecordVersion, readers reject versions they don't know.
+const uint32_t featureRecordMagic = 0x52464853; // "SHFR"
+const uint16_t featureRecordVersion = 1;
+const size_t featureRecordAlignment = 16;
+
+// Payloads of a record, in the order of the segments of a packed feature row
+enum FeatureRecordPayload {
+    RedHistogramPayload,
+    GreenHistogramPayload,
+    BlueHistogramPayload,
+    LBPHistogramPayload,
+    HOGPayload,
+    NrOfFeatureRecordPayloads
+};
+
+struct FeatureRecordHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t nrOfPayloads;
+    uint32_t recordSize;
+    // CRC-32 of everything after the payload table
+    uint32_t checksum;
+    // Zero padded descriptor profile name
+    char descriptorProfile[48];
+};
+
+struct FeatureRecordPayloadEntry {
+    uint8_t depth;
+    uint8_t channels;
+    uint16_t reserved;
+    int32_t rows;
+    int32_t cols;
+    uint32_t offset;
+    uint32_t size;
+};
+
+static_assert(sizeof(FeatureRecordHeader) == 64, "The feature record header is part of the stored format");
+static_assert(sizeof(FeatureRecordPayloadEntry) == 20, "The feature record payload entry is part of the stored format");
+
+// Offset of the first payload, right after the header and the payload table
+size_t featureRecordPayloadsOffset(size_t nrOfPayloads) {
+    size_t tableEnd = sizeof(FeatureRecordHeader) + nrOfPayloads * sizeof(FeatureRecordPayloadEntry);
+    return (tableEnd + featureRecordAlignment - 1) / featureRecordAlignment * featureRecordAlignment;
+}
+
+// CRC-32 (IEEE 802.3) of a byte range
+uint32_t computeCRC32(const uchar* data, size_t size) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> crcTable(256);
+        for (uint32_t byte = 0; byte < 256; byte++) {
+            uint32_t crc = byte;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? 0xEDB88320u ^ (crc >> 1) : crc >> 1;
+            }
+            crcTable[byte] = crc;
+        }
+        return crcTable;
+    }();
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// Serialize the features of one shoe, extracted with the given descriptor profile
+std::vector<uchar> encodeFeatureRecord(const ShoeProperties& shoeProperties, const std::string& descriptorProfile) {
+    if (shoeProperties.rgbHistograms.size() != 3) {
+        throw std::runtime_error("Expected 3 RGB histograms in a feature record");
+    }
+    FeatureRecordHeader header = {};
+    if (descriptorProfile.size() >= sizeof(header.descriptorProfile)) {
+        throw std::runtime_error("Descriptor profile name " + descriptorProfile + " is too long for a feature record");
+    }
+
+    const cv::Mat* payloads[NrOfFeatureRecordPayloads] = {
+        &shoeProperties.rgbHistograms[0],
+        &shoeProperties.rgbHistograms[1],
+        &shoeProperties.rgbHistograms[2],
+        &shoeProperties.lbpHistogram,
+        &shoeProperties.hogFeatures
+    };
+
+    FeatureRecordPayloadEntry entries[NrOfFeatureRecordPayloads] = {};
+    size_t recordSize = featureRecordPayloadsOffset(NrOfFeatureRecordPayloads);
+    for (int payload = 0; payload < NrOfFeatureRecordPayloads; payload++) {
+        const cv::Mat& value = *payloads[payload];
+        if (value.dims > 2) {
+            throw std::runtime_error("Can't store a Mat of more than 2 dimensions in a feature record");
+        }
+        entries[payload].depth = (uint8_t)value.depth();
+        entries[payload].channels = (uint8_t)value.channels();
+        entries[payload].rows = value.rows;
+        entries[payload].cols = value.cols;
+        entries[payload].offset = (uint32_t)recordSize;
+        entries[payload].size = (uint32_t)(value.total() * value.elemSize());
+        recordSize += (entries[payload].size + featureRecordAlignment - 1) / featureRecordAlignment * featureRecordAlignment;
+    }
+
+    std::vector<uchar> record(recordSize, 0);
+    for (int payload = 0; payload < NrOfFeatureRecordPayloads; payload++) {
+        cv::Mat value = payloads[payload]->isContinuous() ? *payloads[payload] : payloads[payload]->clone();
+        std::memcpy(record.data() + entries[payload].offset, value.data, entries[payload].size);
+    }
+
+    size_t payloadsOffset = featureRecordPayloadsOffset(NrOfFeatureRecordPayloads);
+    header.magic = featureRecordMagic;
+    header.version = featureRecordVersion;
+    header.nrOfPayloads = NrOfFeatureRecordPayloads;
+    header.recordSize = (uint32_t)recordSize;
+    header.checksum = computeCRC32(record.data() + payloadsOffset, recordSize - payloadsOffset);
+    std::memcpy(header.descriptorProfile, descriptorProfile.data(), descriptorProfile.size());
+    std::memcpy(record.data(), &header, sizeof(header));
+    std::memcpy(record.data() + sizeof(header), entries, sizeof(entries));
+    return record;
+}
+
+// Read-only view of a serialized feature record. The payloads are Mat headers over the record
+// bytes, nothing is copied, so the view and its payloads are only valid while the bytes are.
+// The bytes have to start at a multiple of featureRecordAlignment, Mat allocations always do.
+struct FeatureRecordView {
+    // Validate the header, the payload table and optionally the checksum, throws on any mismatch
+    FeatureRecordView(const uchar* data, size_t size, bool verifyChecksum = true) : data(data) {
+        if (size < sizeof(FeatureRecordHeader)) {
+            throw std::runtime_error("Feature record of " + std::to_string(size) + " bytes is truncated");
+        }
+        if ((uintptr_t)data % featureRecordAlignment != 0) {
+            throw std::runtime_error("Feature record is not aligned to " + std::to_string(featureRecordAlignment) + " bytes");
+        }
+
+        std::memcpy(&header, data, sizeof(header));
+        if (header.magic != featureRecordMagic) {
+            throw std::runtime_error("Not a feature record");
+        }
+        if (header.version != featureRecordVersion) {
+            throw std::runtime_error("Unsupported feature record version " + std::to_string(header.version));
+        }
+        size_t payloadsOffset = featureRecordPayloadsOffset(header.nrOfPayloads);
+        if (header.nrOfPayloads != NrOfFeatureRecordPayloads || header.recordSize != size || payloadsOffset > size) {
+            throw std::runtime_error("Feature record of " + std::to_string(size) + " bytes has an inconsistent header");
+        }
+        if (header.descriptorProfile[sizeof(header.descriptorProfile) - 1] != '\0') {
+            throw std::runtime_error("Feature record has an unterminated descriptor profile");
+        }
+
+        std::memcpy(entries, data + sizeof(header), sizeof(entries));
+        for (const FeatureRecordPayloadEntry& entry : entries) {
+            size_t expectedSize = (size_t)std::max(0, entry.rows) * std::max(0, entry.cols) * entry.channels * CV_ELEM_SIZE1(entry.depth);
+            if (entry.depth > CV_64F || entry.channels == 0 || entry.channels > CV_CN_MAX || entry.size != expectedSize ||
+                entry.offset % featureRecordAlignment != 0 || entry.offset < payloadsOffset || (size_t)entry.offset + entry.size > size) {
+                throw std::runtime_error("Feature record has an inconsistent payload table");
+            }
+        }
+
+        if (verifyChecksum && computeCRC32(data + payloadsOffset, size - payloadsOffset) != header.checksum) {
+            throw std::runtime_error("Feature record checksum mismatch");
+        }
+    }
+
+    std::string descriptorProfile() const {
+        return header.descriptorProfile;
+    }
+
+    // Mat header over a payload, in its stored type and shape
+    cv::Mat payload(FeatureRecordPayload payload) const {
+        const FeatureRecordPayloadEntry& entry = entries[payload];
+        return cv::Mat(entry.rows, entry.cols, CV_MAKETYPE(entry.depth, entry.channels), (void*)(data + entry.offset));
+    }
+
+    // Mat header over a payload that has to hold nrOfValues values of the given type, in any shape
+    cv::Mat payload(FeatureRecordPayload payload, int type, size_t nrOfValues) const {
+        cv::Mat value = this->payload(payload);
+        if (value.type() != type || value.total() != nrOfValues) {
+            throw std::runtime_error(
+                "Feature record payload " + std::to_string((int)payload) + " holds " + std::to_string(value.total()) +
+                " values of type " + std::to_string(value.type()) + ", expected " + std::to_string(nrOfValues) +
+                " of type " + std::to_string(type));
+        }
+        return value;
+    }
+
+    // Copy the payloads out of the record
+    ShoeProperties toShoeProperties() const {
+        ShoeProperties shoeProperties;
+        shoeProperties.rgbHistograms = {
+            payload(RedHistogramPayload).clone(),
+            payload(GreenHistogramPayload).clone(),
+            payload(BlueHistogramPayload).clone()
+        };
+        shoeProperties.lbpHistogram = payload(LBPHistogramPayload).clone();
+        shoeProperties.hogFeatures = payload(HOGPayload).clone();
+        return shoeProperties;
+    }
+
+private:
+    const uchar* data;
+    FeatureRecordHeader header;
+    FeatureRecordPayloadEntry entries[NrOfFeatureRecordPayloads];
+};
+
+#endif // FEATURE_RECORD_H
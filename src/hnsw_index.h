@@ -0,0 +1,236 @@
+#ifndef HNSW_INDEX_H
+#define HNSW_INDEX_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <queue>
+#include <random>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "feature_matrix.h"
+
+struct HNSWParameters {
+    // Links kept per node on the upper levels, level 0 keeps twice as many
+    int M = 16;
+    // Size of the candidate list while inserting, higher builds a better graph more slowly
+    int efConstruction = 200;
+    // Default size of the candidate list while searching, higher trades speed for recall
+    int efSearch = 64;
+};
+
+// The HOG graph is opt-in with the SHOES_HOG_GRAPH environment variable, since it is built over every
+// shoe at startup and on every reload. The "M", "efConstruction" and "efSearch" defaults can be
+// overridden with SHOES_HOG_GRAPH_M, SHOES_HOG_GRAPH_EF_CONSTRUCTION and SHOES_HOG_GRAPH_EF_SEARCH.
+// Returns false when the graph is not enabled.
+bool getConfiguredHNSWParameters(HNSWParameters& parameters) {
+    const char* hogGraph = std::getenv("SHOES_HOG_GRAPH");
+    if (hogGraph == nullptr || std::atoi(hogGraph) == 0) {
+        return false;
+    }
+
+    const std::pair<const char*, int*> overrides[] = {
+        {"SHOES_HOG_GRAPH_M", &parameters.M},
+        {"SHOES_HOG_GRAPH_EF_CONSTRUCTION", &parameters.efConstruction},
+        {"SHOES_HOG_GRAPH_EF_SEARCH", &parameters.efSearch}
+    };
+    for (const auto& [name, value] : overrides) {
+        const char* setting = std::getenv(name);
+        if (setting != nullptr && std::atoi(setting) > 0) {
+            *value = std::atoi(setting);
+        }
+    }
+    return true;
+}
+
+// Hierarchical navigable small world graph (Malkov & Yashunin) over one segment of the rows
+// of a FeatureMatrix. Nodes are row indices and rows have to be inserted in order. The segments
+// are stored normalized, so the similarity of two nodes is the correlation of their features.
+// The graph does not own the vectors, every call gets the matrix the rows live in.
+struct HNSWIndex {
+    explicit HNSWIndex(HNSWParameters parameters = HNSWParameters(), FeatureSegment segment = HOGSegment)
+        : parameters(parameters),
+          segment(segment),
+          levelMultiplier(1.0 / std::log(std::max(2, parameters.M))),
+          random(42) {}
+
+    size_t size() const { return links.size(); }
+
+    // Link row number size() of the matrix into the graph
+    void insert(const FeatureMatrix& features, size_t row) {
+        int level = randomLevel();
+        links.emplace_back(level + 1);
+
+        if (maxLevel < 0) {
+            entryPoint = row;
+            maxLevel = level;
+            return;
+        }
+
+        const float* query = segmentOf(features, row);
+        size_t current = entryPoint;
+        for (int currentLevel = maxLevel; currentLevel > level; currentLevel--) {
+            current = searchLayer(features, query, current, 1, currentLevel).front().second;
+        }
+
+        for (int currentLevel = std::min(level, maxLevel); currentLevel >= 0; currentLevel--) {
+            std::vector<Candidate> candidates = searchLayer(features, query, current, parameters.efConstruction, currentLevel);
+            links[row][currentLevel] = selectNeighbours(features, candidates, parameters.M);
+            for (uint32_t neighbour : links[row][currentLevel]) {
+                connect(features, neighbour, row, currentLevel);
+            }
+            current = candidates.front().second;
+        }
+
+        if (level > maxLevel) {
+            maxLevel = level;
+            entryPoint = row;
+        }
+    }
+
+    // Approximate k most similar rows to a normalized query segment, most similar first
+    std::vector<std::pair<size_t, float>> search(const FeatureMatrix& features, const float* query, int k, int efSearch = -1) const {
+        std::vector<std::pair<size_t, float>> similarRows;
+        if (links.empty() || k <= 0) {
+            return similarRows;
+        }
+        if (efSearch <= 0) {
+            efSearch = parameters.efSearch;
+        }
+
+        size_t current = entryPoint;
+        for (int currentLevel = maxLevel; currentLevel > 0; currentLevel--) {
+            current = searchLayer(features, query, current, 1, currentLevel).front().second;
+        }
+
+        std::vector<Candidate> candidates = searchLayer(features, query, current, std::max(efSearch, k), 0);
+        for (size_t i = 0; i < candidates.size() && (int)i < k; i++) {
+            similarRows.emplace_back(candidates[i].second, 1.0f - candidates[i].first);
+        }
+        return similarRows;
+    }
+
+private:
+    // Distance to the query and row of a node
+    using Candidate = std::pair<float, size_t>;
+
+    const float* segmentOf(const FeatureMatrix& features, size_t row) const {
+        return features.row(row) + features.layout.offsets[segment];
+    }
+
+    float distance(const FeatureMatrix& features, const float* query, size_t row) const {
+        return 1.0f - dotProduct(query, segmentOf(features, row), features.layout.sizes[segment]);
+    }
+
+    int randomLevel() {
+        double uniform = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+        return (int)(-std::log(std::max(uniform, 1e-12)) * levelMultiplier);
+    }
+
+    int maxLinks(int level) const {
+        return level == 0 ? 2 * parameters.M : parameters.M;
+    }
+
+    // Best first search of a single level, returns up to ef nodes ordered by increasing distance
+    std::vector<Candidate> searchLayer(const FeatureMatrix& features, const float* query, size_t entry, int ef, int level) const {
+        std::unordered_set<size_t> visited = {entry};
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> candidates;
+        std::priority_queue<Candidate> nearest;
+
+        Candidate entryCandidate(distance(features, query, entry), entry);
+        candidates.push(entryCandidate);
+        nearest.push(entryCandidate);
+
+        while (!candidates.empty()) {
+            Candidate closest = candidates.top();
+            if (closest.first > nearest.top().first && (int)nearest.size() >= ef) {
+                break;
+            }
+            candidates.pop();
+
+            for (uint32_t neighbour : links[closest.second][level]) {
+                if (!visited.insert(neighbour).second) {
+                    continue;
+                }
+
+                float neighbourDistance = distance(features, query, neighbour);
+                if ((int)nearest.size() < ef || neighbourDistance < nearest.top().first) {
+                    candidates.emplace(neighbourDistance, neighbour);
+                    nearest.emplace(neighbourDistance, neighbour);
+                    if ((int)nearest.size() > ef) {
+                        nearest.pop();
+                    }
+                }
+            }
+        }
+
+        std::vector<Candidate> result;
+        result.reserve(nearest.size());
+        while (!nearest.empty()) {
+            result.push_back(nearest.top());
+            nearest.pop();
+        }
+        std::reverse(result.begin(), result.end());
+        return result;
+    }
+
+    // Neighbour selection heuristic: keep a candidate only if it is closer to the base node than
+    // to every neighbour kept so far, which spreads the links over different directions.
+    // Candidates have to be ordered by increasing distance, remaining slots are filled with the pruned ones.
+    std::vector<uint32_t> selectNeighbours(const FeatureMatrix& features, const std::vector<Candidate>& candidates, int M) const {
+        std::vector<uint32_t> selected;
+        std::vector<uint32_t> pruned;
+        for (const Candidate& candidate : candidates) {
+            if ((int)selected.size() >= M) {
+                break;
+            }
+
+            const float* candidateSegment = segmentOf(features, candidate.second);
+            bool isDiverse = std::all_of(selected.begin(), selected.end(), [&](uint32_t neighbour) {
+                return distance(features, candidateSegment, neighbour) > candidate.first;
+            });
+            if (isDiverse) {
+                selected.push_back((uint32_t)candidate.second);
+            } else {
+                pruned.push_back((uint32_t)candidate.second);
+            }
+        }
+
+        for (size_t i = 0; i < pruned.size() && (int)selected.size() < M; i++) {
+            selected.push_back(pruned[i]);
+        }
+        return selected;
+    }
+
+    // Add a backlink from node to newNode, pruning the links of node if it has too many
+    void connect(const FeatureMatrix& features, size_t node, size_t newNode, int level) {
+        std::vector<uint32_t>& nodeLinks = links[node][level];
+        nodeLinks.push_back((uint32_t)newNode);
+        if ((int)nodeLinks.size() <= maxLinks(level)) {
+            return;
+        }
+
+        const float* nodeSegment = segmentOf(features, node);
+        std::vector<Candidate> candidates;
+        candidates.reserve(nodeLinks.size());
+        for (uint32_t neighbour : nodeLinks) {
+            candidates.emplace_back(distance(features, nodeSegment, neighbour), neighbour);
+        }
+        std::sort(candidates.begin(), candidates.end());
+        nodeLinks = selectNeighbours(features, candidates, maxLinks(level));
+    }
+
+    HNSWParameters parameters;
+    FeatureSegment segment;
+    double levelMultiplier;
+    std::mt19937 random;
+
+    // links[row][level] holds the neighbours of a node on one level of the graph
+    std::vector<std::vector<std::vector<uint32_t>>> links;
+    size_t entryPoint = 0;
+    int maxLevel = -1;
+};
+
+#endif // HNSW_INDEX_H
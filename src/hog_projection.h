@@ -0,0 +1,146 @@
+#ifndef HOG_PROJECTION_H
+#define HOG_PROJECTION_H
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// Where the fitted projection is persisted, relative to the working directory of the server
+const std::string defaultHOGProjectionPath = "hog_projection.yml.gz";
+
+struct HOGProjectionParameters {
+    // Number of principal components the HOG features are projected onto
+    int dimension = 128;
+    // Scale every component to unit variance, so no single component dominates the correlation
+    bool whiten = false;
+    // Descriptors sampled to fit the projection, every stored descriptor is projected afterwards
+    int maxTrainingRows = 50000;
+};
+
+// PCA projection of the 3780 float HOG descriptors onto their first principal components.
+// The whitening is folded into the projection matrix, so projecting is a single matrix product.
+struct HOGProjection {
+    static constexpr int fileVersion = 1;
+
+    bool whitened = false;
+    // 1 x inputSize mean of the training descriptors
+    cv::Mat mean;
+    // dimension x inputSize projection matrix, one principal component per row
+    cv::Mat components;
+    // Variance captured by every component
+    cv::Mat eigenvalues;
+    // Share of the total training variance kept by the projection
+    double retainedVariance = 0.0;
+
+    bool isTrained() const { return !components.empty(); }
+
+    int inputSize() const { return components.cols; }
+    int dimension() const { return components.rows; }
+
+    // Identifies the reduced descriptors stored by this projection, e.g. "pca128w"
+    std::string name() const {
+        return "pca" + std::to_string(dimension()) + (whitened ? "w" : "");
+    }
+
+    // Fit the projection on one descriptor per row
+    void train(const cv::Mat& descriptors, HOGProjectionParameters parameters = HOGProjectionParameters()) {
+        if (descriptors.rows < 2 || descriptors.type() != CV_32F) {
+            throw std::runtime_error("Can't fit a HOG projection on fewer than 2 float descriptors");
+        }
+
+        // Sample the training rows with a fixed seed so training is reproducible
+        std::vector<int> rows(descriptors.rows);
+        for (size_t i = 0; i < rows.size(); i++) {
+            rows[i] = (int)i;
+        }
+        cv::RNG random(42);
+        for (size_t i = rows.size() - 1; i > 0; i--) {
+            std::swap(rows[i], rows[random.uniform(0, (int)i + 1)]);
+        }
+        rows.resize(std::min<size_t>(rows.size(), std::max(2, parameters.maxTrainingRows)));
+
+        cv::Mat trainingRows((int)rows.size(), descriptors.cols, CV_32F);
+        for (size_t i = 0; i < rows.size(); i++) {
+            descriptors.row(rows[i]).copyTo(trainingRows.row((int)i));
+        }
+
+        int nrOfComponents = std::min({parameters.dimension, trainingRows.rows, trainingRows.cols});
+        cv::PCA pca(trainingRows, cv::noArray(), cv::PCA::DATA_AS_ROW, nrOfComponents);
+
+        mean = pca.mean.clone();
+        eigenvalues = pca.eigenvalues.clone();
+        components = pca.eigenvectors.clone();
+        whitened = parameters.whiten;
+        if (whitened) {
+            for (int component = 0; component < components.rows; component++) {
+                float eigenvalue = eigenvalues.at<float>(component);
+                cv::Mat componentRow = components.row(component);
+                componentRow *= 1.0 / std::sqrt(std::max(eigenvalue, 1e-6f));
+            }
+        }
+
+        // The total variance is the trace of the covariance matrix, the sum of the per-dimension variances
+        cv::Mat centredRows;
+        cv::subtract(trainingRows, cv::repeat(mean, trainingRows.rows, 1), centredRows);
+        double totalVariance = centredRows.dot(centredRows) / std::max(1, trainingRows.rows - 1);
+        retainedVariance = totalVariance > 0.0 ? cv::sum(eigenvalues)[0] / totalVariance : 0.0;
+    }
+
+    // Project descriptors, one per row, or a single descriptor of any shape.
+    // Returns one CV_32F row of dimension values per descriptor.
+    cv::Mat project(const cv::Mat& descriptors) const {
+        if (!isTrained()) {
+            throw std::runtime_error("The HOG projection is not trained");
+        }
+        if (descriptors.type() != CV_32F || descriptors.total() % inputSize() != 0) {
+            throw std::runtime_error(
+                "Can't project " + std::to_string(descriptors.total()) + " values of type " +
+                std::to_string(descriptors.type()) + " onto a projection of " + std::to_string(inputSize()) + " floats");
+        }
+
+        cv::Mat rows = (descriptors.isContinuous() ? descriptors : descriptors.clone()).reshape(1, (int)(descriptors.total() / inputSize()));
+        cv::Mat centredRows;
+        cv::subtract(rows, cv::repeat(mean, rows.rows, 1), centredRows);
+
+        cv::Mat projected;
+        cv::gemm(centredRows, components, 1.0, cv::noArray(), 0.0, projected, cv::GEMM_2_T);
+        return projected;
+    }
+
+    void save(const std::string& path) const {
+        cv::FileStorage file(path, cv::FileStorage::WRITE);
+        if (!file.isOpened()) {
+            throw std::runtime_error("Can't open " + path + " for writing");
+        }
+
+        file << "version" << fileVersion;
+        file << "whitened" << (int)whitened;
+        file << "retainedVariance" << retainedVariance;
+        file << "mean" << mean;
+        file << "components" << components;
+        file << "eigenvalues" << eigenvalues;
+        file.release();
+    }
+
+    void load(const std::string& path) {
+        cv::FileStorage file(path, cv::FileStorage::READ);
+        if (!file.isOpened()) {
+            throw std::runtime_error("Can't open " + path + " for reading");
+        }
+        if ((int)file["version"] != fileVersion) {
+            throw std::runtime_error(path + " has an unsupported HOG projection version");
+        }
+
+        whitened = (int)file["whitened"] != 0;
+        retainedVariance = (double)file["retainedVariance"];
+        file["mean"] >> mean;
+        file["components"] >> components;
+        file["eigenvalues"] >> eigenvalues;
+    }
+};
+
+#endif // HOG_PROJECTION_H
@@ -0,0 +1,277 @@
+#ifndef IVFPQ_INDEX_H
+#define IVFPQ_INDEX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "feature_matrix.h"
+#include "top_k.h"
+
+// Where the trained index is persisted, relative to the working directory of the server
+const std::string defaultIVFPQIndexPath = "ivfpq_index.yml.gz";
+
+// With the SHOES_IVFPQ_CODES_ONLY environment variable set, the feature index keeps only the ids and
+// codes of a loaded IVF-PQ index resident instead of the full precision features of every shoe
+bool isIVFPQCodesOnlyConfigured() {
+    const char* codesOnly = std::getenv("SHOES_IVFPQ_CODES_ONLY");
+    return codesOnly != nullptr && std::atoi(codesOnly) != 0;
+}
+
+struct IVFPQParameters {
+    // Number of coarse centroids, every shoe is stored in the inverted list of its closest one
+    int nrOfLists = 256;
+    // Floats per product quantization subvector, has to divide the 16 float row alignment
+    int subvectorSize = 16;
+    // Rows sampled to train the quantizers, the whole catalogue is encoded afterwards
+    int maxTrainingRows = 50000;
+    int trainingIterations = 20;
+    // Default number of inverted lists visited per query
+    int nrOfProbes = 8;
+};
+
+// Inverted file index with product quantized residuals (Jegou et al.) over the packed, normalized
+// feature rows. A shoe is held as the id of its coarse list plus one byte per subvector, about
+// 300 bytes instead of the 19 KB of its full precision row. Scores are approximated with
+// asymmetric distance lookup tables and the best candidates are meant to be re-ranked exactly.
+struct IVFPQIndex {
+    static constexpr int nrOfCodewords = 256;
+    static constexpr int fileVersion = 1;
+
+    FeatureLayout layout;
+    IVFPQParameters parameters;
+    // nrOfLists x rowStride coarse centroids
+    cv::Mat coarseCentroids;
+    // (nrOfSubquantizers * 256) x subvectorSize, codebook m holds the rows [m * 256, (m + 1) * 256)
+    cv::Mat codebooks;
+    // Shoe image ids and concatenated codes of every inverted list
+    std::vector<std::vector<int>> listShoeImageIds;
+    std::vector<std::vector<uint8_t>> listCodes;
+
+    bool isTrained() const { return !coarseCentroids.empty(); }
+
+    int nrOfSubquantizers() const { return layout.rowStride / parameters.subvectorSize; }
+
+    size_t size() const {
+        size_t nrOfShoes = 0;
+        for (const std::vector<int>& shoeImageIds : listShoeImageIds) {
+            nrOfShoes += shoeImageIds.size();
+        }
+        return nrOfShoes;
+    }
+
+    // Train the coarse centroids and the residual codebooks on (a sample of) the rows
+    void train(const FeatureMatrix& features, IVFPQParameters trainingParameters = IVFPQParameters()) {
+        if (features.rows() == 0) {
+            throw std::runtime_error("Can't train an IVF-PQ index without features");
+        }
+        if (floatsPerAlignment % trainingParameters.subvectorSize != 0) {
+            throw std::runtime_error("IVF-PQ subvector size has to divide " + std::to_string(floatsPerAlignment));
+        }
+        layout = features.layout;
+        parameters = trainingParameters;
+
+        // Sample the training rows with a fixed seed so training is reproducible
+        std::vector<int> rows(features.rows());
+        for (size_t i = 0; i < rows.size(); i++) {
+            rows[i] = (int)i;
+        }
+        cv::RNG random(42);
+        for (size_t i = rows.size() - 1; i > 0; i--) {
+            std::swap(rows[i], rows[random.uniform(0, (int)i + 1)]);
+        }
+        rows.resize(std::min<size_t>(rows.size(), std::max(1, parameters.maxTrainingRows)));
+
+        cv::Mat trainingRows((int)rows.size(), layout.rowStride, CV_32F);
+        for (size_t i = 0; i < rows.size(); i++) {
+            std::copy(features.row(rows[i]), features.row(rows[i]) + layout.rowStride, trainingRows.ptr<float>((int)i));
+        }
+
+        cv::TermCriteria criteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, parameters.trainingIterations, 1e-4);
+        parameters.nrOfLists = std::min(parameters.nrOfLists, trainingRows.rows);
+        cv::Mat labels;
+        cv::kmeans(trainingRows, parameters.nrOfLists, labels, criteria, 1, cv::KMEANS_PP_CENTERS, coarseCentroids);
+
+        // Product quantizers are trained on the residuals to the coarse centroids
+        cv::Mat residuals(trainingRows.size(), CV_32F);
+        for (int i = 0; i < trainingRows.rows; i++) {
+            cv::subtract(trainingRows.row(i), coarseCentroids.row(labels.at<int>(i)), residuals.row(i));
+        }
+
+        int codewords = std::min(nrOfCodewords, trainingRows.rows);
+        codebooks = cv::Mat::zeros(nrOfSubquantizers() * nrOfCodewords, parameters.subvectorSize, CV_32F);
+        for (int m = 0; m < nrOfSubquantizers(); m++) {
+            cv::Mat subvectors = residuals.colRange(m * parameters.subvectorSize, (m + 1) * parameters.subvectorSize).clone();
+            cv::Mat subvectorLabels, codebook;
+            cv::kmeans(subvectors, codewords, subvectorLabels, criteria, 1, cv::KMEANS_PP_CENTERS, codebook);
+            codebook.copyTo(codebooks.rowRange(m * nrOfCodewords, m * nrOfCodewords + codewords));
+        }
+
+        listShoeImageIds.assign(parameters.nrOfLists, {});
+        listCodes.assign(parameters.nrOfLists, {});
+    }
+
+    // Encode a packed, normalized row and append it to its inverted list
+    void add(int shoeImageId, const float* row) {
+        int list = closestCentroid(coarseCentroids, row, layout.rowStride);
+
+        std::vector<float> residual(layout.rowStride);
+        const float* centroid = coarseCentroids.ptr<float>(list);
+        for (int i = 0; i < layout.rowStride; i++) {
+            residual[i] = row[i] - centroid[i];
+        }
+
+        for (int m = 0; m < nrOfSubquantizers(); m++) {
+            cv::Mat codebook = codebooks.rowRange(m * nrOfCodewords, (m + 1) * nrOfCodewords);
+            int code = closestCentroid(codebook, residual.data() + m * parameters.subvectorSize, parameters.subvectorSize);
+            listCodes[list].push_back((uint8_t)code);
+        }
+        listShoeImageIds[list].push_back(shoeImageId);
+    }
+
+    void addAll(const FeatureMatrix& features) {
+        for (size_t i = 0; i < features.rows(); i++) {
+            add(features.shoeImageIds[i], features.row(i));
+        }
+    }
+
+    // Approximate best scoring shoes for a weighted query (see FeatureQuery), highest score first
+    std::vector<std::pair<int, float>> search(const FeatureQuery& query, int nrOfCandidates, int nrOfProbes = 0) const {
+        if (!isTrained() || query.layout != layout) {
+            return {};
+        }
+        if (nrOfProbes <= 0) {
+            nrOfProbes = parameters.nrOfProbes;
+        }
+        nrOfProbes = std::min(nrOfProbes, coarseCentroids.rows);
+
+        // Score of the query against every coarse centroid, the closest lists are probed
+        cv::Mat centroidScores;
+        cv::gemm(coarseCentroids, query.weightedMat(), 1.0, cv::noArray(), 0.0, centroidScores, cv::GEMM_2_T);
+        TopKShoes probedLists(nrOfProbes);
+        for (int list = 0; list < centroidScores.rows; list++) {
+            probedLists.push(list, centroidScores.at<float>(list));
+        }
+
+        // Lookup table of the query subvectors against every codeword, shared by all lists
+        // because the codebooks quantize residuals
+        const int M = nrOfSubquantizers();
+        std::vector<float> lookupTable(M * nrOfCodewords);
+        for (int m = 0; m < M; m++) {
+            const float* querySubvector = query.weightedValues.get() + m * parameters.subvectorSize;
+            for (int code = 0; code < nrOfCodewords; code++) {
+                const float* codeword = codebooks.ptr<float>(m * nrOfCodewords + code);
+                float dot = 0.0f;
+                for (int i = 0; i < parameters.subvectorSize; i++) {
+                    dot += querySubvector[i] * codeword[i];
+                }
+                lookupTable[m * nrOfCodewords + code] = dot;
+            }
+        }
+
+        TopKShoes candidates(nrOfCandidates);
+        for (const auto& [list, centroidScore] : probedLists.sorted()) {
+            const uint8_t* codes = listCodes[list].data();
+            for (size_t i = 0; i < listShoeImageIds[list].size(); i++, codes += M) {
+                float score = centroidScore;
+                for (int m = 0; m < M; m++) {
+                    score += lookupTable[m * nrOfCodewords + codes[m]];
+                }
+                candidates.push(listShoeImageIds[list][i], score);
+            }
+        }
+        return candidates.sorted();
+    }
+
+    void save(const std::string& path) const {
+        cv::FileStorage file(path, cv::FileStorage::WRITE);
+        if (!file.isOpened()) {
+            throw std::runtime_error("Can't open " + path + " for writing");
+        }
+
+        // Inverted lists are flattened into one id, list and code row per shoe
+        cv::Mat shoeImageIds((int)size(), 1, CV_32S);
+        cv::Mat lists((int)size(), 1, CV_32S);
+        cv::Mat codes((int)size(), nrOfSubquantizers(), CV_8U);
+        int shoe = 0;
+        for (size_t list = 0; list < listShoeImageIds.size(); list++) {
+            for (size_t i = 0; i < listShoeImageIds[list].size(); i++, shoe++) {
+                shoeImageIds.at<int>(shoe) = listShoeImageIds[list][i];
+                lists.at<int>(shoe) = (int)list;
+                std::copy_n(listCodes[list].data() + i * nrOfSubquantizers(), nrOfSubquantizers(), codes.ptr<uint8_t>(shoe));
+            }
+        }
+
+        file << "version" << fileVersion;
+        file << "rgbBins" << layout.sizes[RedSegment];
+        file << "lbpBins" << layout.sizes[LBPSegment];
+        file << "hogSize" << layout.sizes[HOGSegment];
+        file << "subvectorSize" << parameters.subvectorSize;
+        file << "nrOfProbes" << parameters.nrOfProbes;
+        file << "coarseCentroids" << coarseCentroids;
+        file << "codebooks" << codebooks;
+        file << "shoeImageIds" << shoeImageIds;
+        file << "lists" << lists;
+        file << "codes" << codes;
+        file.release();
+    }
+
+    void load(const std::string& path) {
+        cv::FileStorage file(path, cv::FileStorage::READ);
+        if (!file.isOpened()) {
+            throw std::runtime_error("Can't open " + path + " for reading");
+        }
+        if ((int)file["version"] != fileVersion) {
+            throw std::runtime_error(path + " has an unsupported IVF-PQ index version");
+        }
+
+        layout = FeatureLayout((int)file["rgbBins"], (int)file["lbpBins"], (int)file["hogSize"]);
+        parameters.subvectorSize = (int)file["subvectorSize"];
+        parameters.nrOfProbes = (int)file["nrOfProbes"];
+
+        cv::Mat shoeImageIds, lists, codes;
+        file["coarseCentroids"] >> coarseCentroids;
+        file["codebooks"] >> codebooks;
+        file["shoeImageIds"] >> shoeImageIds;
+        file["lists"] >> lists;
+        file["codes"] >> codes;
+        parameters.nrOfLists = coarseCentroids.rows;
+
+        listShoeImageIds.assign(parameters.nrOfLists, {});
+        listCodes.assign(parameters.nrOfLists, {});
+        for (int shoe = 0; shoe < shoeImageIds.rows; shoe++) {
+            int list = lists.at<int>(shoe);
+            listShoeImageIds[list].push_back(shoeImageIds.at<int>(shoe));
+            listCodes[list].insert(listCodes[list].end(), codes.ptr<uint8_t>(shoe), codes.ptr<uint8_t>(shoe) + nrOfSubquantizers());
+        }
+    }
+
+private:
+    // Row of centroids with the smallest L2 distance to the vector
+    static int closestCentroid(const cv::Mat& centroids, const float* vector, int size) {
+        int closest = 0;
+        float minimumDistance = std::numeric_limits<float>::max();
+        for (int i = 0; i < centroids.rows; i++) {
+            const float* centroid = centroids.ptr<float>(i);
+            float distance = 0.0f;
+#pragma omp simd reduction(+ : distance)
+            for (int j = 0; j < size; j++) {
+                float difference = vector[j] - centroid[j];
+                distance += difference * difference;
+            }
+            if (distance < minimumDistance) {
+                minimumDistance = distance;
+                closest = i;
+            }
+        }
+        return closest;
+    }
+};
+
+#endif // IVFPQ_INDEX_H
@@ -1,18 +1,110 @@
 #ifndef SERVICE_H
 #define SERVICE_H
 
+#include <algorithm>
 #include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
 #include "compute.h"
+#include "database_features.h"
+#include "database_shoes.h"
 
-void recalculateHistograms() {
-    try {
-        // Get shoe images from Django server
+// Recalculate and store the features of every shoe image in the catalogue for a descriptor profile.
+// The images are processed in batches of batchSize: every batch is decoded and extracted in parallel,
+// then bulk loaded with a single merge. Shoes that fail are logged and skipped.
+// Returns the number of shoes that were recalculated.
+int recalculateShoeFeatures(const DescriptorProfile& profile = getDescriptorProfile(), int batchSize = 2000, int k = 4) {
+    std::vector<int> shoeImageIds = getAllShoeImageIds();
+    batchSize = std::max(1, batchSize);
 
+    int nrOfRecalculatedShoes = 0;
+    for (size_t batchStart = 0; batchStart < shoeImageIds.size(); batchStart += batchSize) {
+        std::vector<int> batchIds(
+            shoeImageIds.begin() + batchStart,
+            shoeImageIds.begin() + std::min(shoeImageIds.size(), batchStart + batchSize));
+        std::vector<std::pair<int, std::vector<uchar>>> encodedImages = getEncodedShoeImages(batchIds);
 
-    } catch (const std::exception &e) {
-        std::cerr << e.what() << std::endl;
+        std::vector<ShoeFeatureRecord> records(encodedImages.size());
+        std::vector<char> succeeded(encodedImages.size(), 0);
+        runBatchTasks((int)encodedImages.size(), [&](int image) {
+            int shoeImageId = encodedImages[image].first;
+            try {
+                const std::vector<uchar>& encodedImage = encodedImages[image].second;
+                cv::Mat shoeImage;
+                std::string errorMessage;
+                if (decodeUploadedImage(encodedImage.data(), encodedImage.size(), shoeImage, errorMessage) != 200) {
+                    throw std::runtime_error(errorMessage);
+                }
 
+                FeatureExtractionPipeline pipeline(segmentShoe(shoeImage));
+                records[image].shoeImageId = shoeImageId;
+                records[image].shoeProperties = pipeline.computeShoeFeatures(profile);
+                records[image].shoeColor = pipeline.computeShoeColorRGB();
+                records[image].dominantColors = pipeline.computeDominantColors(k);
+                succeeded[image] = 1;
+            } catch (const std::exception &e) {
+                std::cerr << "Skipping features of shoe image " << shoeImageId << ": " << e.what() << std::endl;
+            }
+        });
+
+        std::vector<ShoeFeatureRecord> recalculatedRecords;
+        recalculatedRecords.reserve(records.size());
+        for (size_t i = 0; i < records.size(); i++) {
+            if (succeeded[i]) {
+                recalculatedRecords.push_back(std::move(records[i]));
+            }
+        }
+
+        nrOfRecalculatedShoes += (int)bulkSaveShoeFeatureRecords(recalculatedRecords, profile.name);
+        std::cout << "Recalculated " << nrOfRecalculatedShoes << " of " << shoeImageIds.size() << " shoe images" << std::endl;
+    }
+
+    return nrOfRecalculatedShoes;
+}
+
+// Store a feature record for every shoe whose features of a descriptor profile are only stored in
+// the separate feature tables, which are no longer written, so they can be loaded from the record column.
+// Returns the number of shoes that got a feature record.
+int backfillFeatureRecords(const std::string& descriptorProfile = legacyDescriptorProfileName, int batchSize = 1000) {
+    std::vector<int> shoeImageIds = getAllShoeImageIds();
+    batchSize = std::max(1, batchSize);
+
+    int nrOfBackfilledShoes = 0;
+    for (size_t batchStart = 0; batchStart < shoeImageIds.size(); batchStart += batchSize) {
+        std::vector<int> batchIds(
+            shoeImageIds.begin() + batchStart,
+            shoeImageIds.begin() + std::min(shoeImageIds.size(), batchStart + batchSize));
+        ShoePropertiesList storedFeatures = getLegacyShoeProperties(batchIds, descriptorProfile);
+
+        std::vector<ShoeProperties> shoeProperties;
+        for (size_t i = 0; i < storedFeatures.shoeImageIds.size(); i++) {
+            shoeProperties.push_back({storedFeatures.RGBHistograms[i], storedFeatures.LBPHistograms[i], storedFeatures.HOGFeatures[i]});
+        }
+        saveFeatureRecords(storedFeatures.shoeImageIds, shoeProperties, descriptorProfile);
+        nrOfBackfilledShoes += (int)shoeProperties.size();
     }
+
+    return nrOfBackfilledShoes;
+}
+
+// Compute and save the dominant colors of every shoe image that has none stored yet.
+// Shoes that fail are logged and skipped, returns the number of shoes that were backfilled.
+int backfillDominantColors(int k = 4) {
+    std::vector<int> shoeImageIds = getShoeImageIdsWithoutDominantColors();
+
+    int nrOfBackfilledShoes = 0;
+    for (int shoeImageId : shoeImageIds) {
+        try {
+            FeatureExtractionPipeline pipeline(segmentShoe(getShoeImageByID(shoeImageId)));
+            saveDominantColors(shoeImageId, pipeline.computeDominantColors(k));
+            nrOfBackfilledShoes++;
+        } catch (const std::exception &e) {
+            std::cerr << "Skipping dominant colors of shoe image " << shoeImageId << ": " << e.what() << std::endl;
+        }
+    }
+
+    return nrOfBackfilledShoes;
 }
 
 #endif
\ No newline at end of file
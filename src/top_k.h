@@ -0,0 +1,64 @@
+#ifndef TOP_K_H
+#define TOP_K_H
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Keeps the k highest scoring (id, score) pairs seen so far in a bounded min-heap,
+// so every candidate costs O(log k) and the k-th best score is always at hand.
+struct TopKShoes {
+    explicit TopKShoes(int k = 5) : k(std::max(k, 0)) {
+        heap.reserve(this->k);
+    }
+
+    bool isFull() const { return (int)heap.size() >= k; }
+
+    // Score a candidate has to beat to enter the result, lowest float while the heap is not full
+    float threshold() const {
+        return isFull() && k > 0 ? heap.front().second : std::numeric_limits<float>::lowest();
+    }
+
+    void push(int shoeImageId, float score) {
+        if (k == 0) {
+            return;
+        }
+        if (!isFull()) {
+            heap.emplace_back(shoeImageId, score);
+            std::push_heap(heap.begin(), heap.end(), lowestScoreFirst);
+            return;
+        }
+        if (score <= heap.front().second) {
+            return;
+        }
+        std::pop_heap(heap.begin(), heap.end(), lowestScoreFirst);
+        heap.back() = std::make_pair(shoeImageId, score);
+        std::push_heap(heap.begin(), heap.end(), lowestScoreFirst);
+    }
+
+    void merge(const TopKShoes& other) {
+        for (const auto& [shoeImageId, score] : other.heap) {
+            push(shoeImageId, score);
+        }
+    }
+
+    // Results ordered from the most to the least similar shoe
+    std::vector<std::pair<int, float>> sorted() const {
+        std::vector<std::pair<int, float>> shoeImages = heap;
+        std::sort(shoeImages.begin(), shoeImages.end(), [](const std::pair<int, float>& a, const std::pair<int, float>& b) {
+            return a.second > b.second;
+        });
+        return shoeImages;
+    }
+
+private:
+    static bool lowestScoreFirst(const std::pair<int, float>& a, const std::pair<int, float>& b) {
+        return a.second > b.second;
+    }
+
+    int k;
+    std::vector<std::pair<int, float>> heap;
+};
+
+#endif // TOP_K_H
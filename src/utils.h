@@ -3,10 +3,157 @@
 
 #include <opencv2/opencv.hpp>
 #include <pqxx/pqxx>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <sstream>
 #include "crow.h"
 #include "crow/middlewares/cors.h"
 
+// Side length of the square images features are computed on, see preprocessImages
+constexpr int featureImageSize = 128;
+// Uploads with more pixels are rejected before they are decoded
+constexpr long long maxUploadPixels = 50000000;
+
+struct ImageDimensions {
+    int width = 0;
+    int height = 0;
+};
+
+uint32_t readBigEndian(const uchar* bytes, int nrOfBytes) {
+    uint32_t value = 0;
+    for (int i = 0; i < nrOfBytes; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+uint32_t readLittleEndian(const uchar* bytes, int nrOfBytes) {
+    uint32_t value = 0;
+    for (int i = nrOfBytes - 1; i >= 0; i--) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+// Read the dimensions of a JPEG, PNG, WebP or BMP image from its header without decoding any pixels.
+// Returns false for other formats and for headers that can't be parsed.
+bool probeImageDimensions(const uchar* data, size_t size, ImageDimensions& dimensions) {
+    // PNG: signature followed by the IHDR chunk, which starts with the width and height
+    static const uchar pngSignature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    if (size >= 24 && std::memcmp(data, pngSignature, 8) == 0 && std::memcmp(data + 12, "IHDR", 4) == 0) {
+        dimensions.width = (int)readBigEndian(data + 16, 4);
+        dimensions.height = (int)readBigEndian(data + 20, 4);
+        return dimensions.width > 0 && dimensions.height > 0;
+    }
+
+    // JPEG: walk the marker segments up to the start of frame, which holds the height and width
+    if (size >= 4 && data[0] == 0xFF && data[1] == 0xD8) {
+        size_t position = 2;
+        while (position + 4 <= size) {
+            if (data[position] != 0xFF) {
+                return false;
+            }
+            uchar marker = data[position + 1];
+            if (marker == 0xFF) {
+                // Fill byte
+                position++;
+                continue;
+            }
+            if (marker == 0xD8 || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+                // Markers without a segment
+                position += 2;
+                continue;
+            }
+
+            size_t segmentLength = readBigEndian(data + position + 2, 2);
+            bool isStartOfFrame = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+            if (isStartOfFrame) {
+                if (position + 9 > size) {
+                    return false;
+                }
+                dimensions.height = (int)readBigEndian(data + position + 5, 2);
+                dimensions.width = (int)readBigEndian(data + position + 7, 2);
+                return dimensions.width > 0 && dimensions.height > 0;
+            }
+            if (marker == 0xD9 || marker == 0xDA || segmentLength < 2) {
+                // End of image or start of scan before any frame header
+                return false;
+            }
+            position += 2 + segmentLength;
+        }
+    }
+
+    // WebP: RIFF container whose first chunk is a lossy, lossless or extended format header
+    if (size >= 30 && std::memcmp(data, "RIFF", 4) == 0 && std::memcmp(data + 8, "WEBP", 4) == 0) {
+        if (std::memcmp(data + 12, "VP8 ", 4) == 0 && data[23] == 0x9D && data[24] == 0x01 && data[25] == 0x2A) {
+            dimensions.width = (int)(readLittleEndian(data + 26, 2) & 0x3FFF);
+            dimensions.height = (int)(readLittleEndian(data + 28, 2) & 0x3FFF);
+        } else if (std::memcmp(data + 12, "VP8L", 4) == 0 && data[20] == 0x2F) {
+            uint32_t bits = readLittleEndian(data + 21, 4);
+            dimensions.width = (int)(bits & 0x3FFF) + 1;
+            dimensions.height = (int)((bits >> 14) & 0x3FFF) + 1;
+        } else if (std::memcmp(data + 12, "VP8X", 4) == 0) {
+            dimensions.width = (int)readLittleEndian(data + 24, 3) + 1;
+            dimensions.height = (int)readLittleEndian(data + 27, 3) + 1;
+        } else {
+            return false;
+        }
+        return dimensions.width > 0 && dimensions.height > 0;
+    }
+
+    // BMP: file header followed by a DIB header starting with the width and height, the height is negative for top-down rows
+    if (size >= 26 && data[0] == 'B' && data[1] == 'M' && readLittleEndian(data + 14, 4) >= 12) {
+        if (readLittleEndian(data + 14, 4) == 12) {
+            // OS/2 core header with 16 bit dimensions
+            dimensions.width = (int)readLittleEndian(data + 18, 2);
+            dimensions.height = (int)readLittleEndian(data + 20, 2);
+        } else {
+            dimensions.width = (int32_t)readLittleEndian(data + 18, 4);
+            dimensions.height = std::abs((int32_t)readLittleEndian(data + 22, 4));
+        }
+        return dimensions.width > 0 && dimensions.height > 0;
+    }
+
+    return false;
+}
+
+// Decode an uploaded image at the smallest power of two reduction that still covers the feature
+// resolution. For JPEG the reduction happens while decoding (DCT domain scaling), so phone
+// photos never get a full resolution pixel buffer. Only formats whose dimensions can be probed are
+// decoded, so the pixel limit applies to every image that reaches a decoder. Returns an HTTP status
+// code, on anything other than 200 the image is empty and errorMessage says why.
+int decodeUploadedImage(const uchar* data, size_t size, cv::Mat& image, std::string& errorMessage) {
+    int decodeFlags = cv::IMREAD_COLOR;
+
+    ImageDimensions dimensions;
+    if (!probeImageDimensions(data, size, dimensions)) {
+        errorMessage = "Unsupported or malformed image, expected a JPEG, PNG, WebP or BMP image";
+        return 415;
+    }
+    if ((long long)dimensions.width * dimensions.height > maxUploadPixels) {
+        errorMessage = "Image of " + std::to_string(dimensions.width) + "x" + std::to_string(dimensions.height) + " pixels is too large";
+        return 413;
+    }
+
+    int smallestSide = std::min(dimensions.width, dimensions.height);
+    if (smallestSide >= 8 * featureImageSize) {
+        decodeFlags = cv::IMREAD_REDUCED_COLOR_8;
+    } else if (smallestSide >= 4 * featureImageSize) {
+        decodeFlags = cv::IMREAD_REDUCED_COLOR_4;
+    } else if (smallestSide >= 2 * featureImageSize) {
+        decodeFlags = cv::IMREAD_REDUCED_COLOR_2;
+    }
+
+    cv::Mat encodedImage(1, (int)size, CV_8UC1, (void*)data);
+    image = cv::imdecode(encodedImage, decodeFlags);
+    if (image.empty()) {
+        errorMessage = "Failed to decode image data";
+        return 400;
+    }
+    return 200;
+}
+
 struct ImageResponse {
     cv::Mat image;
     int statusCode;
@@ -96,17 +243,10 @@ ImageResponse convertImageRequestToMat(const crow::request& req) {
         response.errorMessage = "Invalid image data after extraction";
         return response;
     }
-    // Convert the image data from string to vector of bytes
-    std::vector<uchar> imageDataVec(imageData.begin(), imageData.end());
-
-    // Decode the image data using OpenCV
-    response.image = imdecode(imageDataVec, cv::IMREAD_COLOR);
 
-    // Check if the image was successfully decoded
-    if (response.image.empty()) {
-        response.statusCode = 400;
-        response.errorMessage = "Failed to decode image data";
-    }
+    // Decode the image data at the smallest resolution that still covers the feature size
+    response.statusCode = decodeUploadedImage(
+        (const uchar*)imageData.data(), imageData.size(), response.image, response.errorMessage);
 
     return response;
 }
@@ -148,19 +288,9 @@ ImageAndIdResponse convertImageAndIdRequestToMat(const crow::request& req) {
         return response;
     }
 
-    CROW_LOG_INFO << "before string to vector of bytes";
-
-    // Convert the image data from string to vector of bytes
-    std::vector<uchar> imageDataVec(imageData.begin(), imageData.end());
-
-    // Decode the image data using OpenCV
-    response.image = imdecode(imageDataVec, cv::IMREAD_COLOR);
-
-    // Check if the image was successfully decoded
-    if (response.image.empty()) {
-        response.statusCode = 400;
-        response.errorMessage = "Failed to decode image data";
-    }
+    // Decode the image data at the smallest resolution that still covers the feature size
+    response.statusCode = decodeUploadedImage(
+        (const uchar*)imageData.data(), imageData.size(), response.image, response.errorMessage);
 
     CROW_LOG_INFO << "before idString";
 
@@ -234,16 +364,15 @@ ImagesResponse convertImagesRequestToMat(const crow::request& req) {
 
         size_t imageDataSize = imageEnd - imageStart;
 
-        // Create a Mat header for the image data
-        cv::Mat imageDataMat = cv::Mat(1, imageDataSize, CV_8UC1, (void*)(req.body.data() + imageStart));
-
-        // Decode the image
-        cv::Mat image = cv::imdecode(imageDataMat, cv::IMREAD_COLOR);
+        // Decode the image straight from the request body
+        cv::Mat image;
+        std::string errorMessage;
+        int statusCode = decodeUploadedImage((const uchar*)(req.body.data() + imageStart), imageDataSize, image, errorMessage);
 
         // Check if decoding was successful
-        if (image.empty()) {
-            response.statusCode = 400;
-            response.errorMessage = "Image decoding failed";
+        if (statusCode != 200) {
+            response.statusCode = statusCode;
+            response.errorMessage = "Image decoding failed: " + errorMessage;
             return response;
         }
 
@@ -312,9 +441,13 @@ ImageAndClassification convertRequestToImageAndClassification(const crow::reques
     std::cout << "Image part found" << std::endl;
 
     // Decode the image from the crow::multipart::mp_map::iterator
-    // Convert to a byte stream and then decode using cv imdecode
-    std::vector<uchar> imageData(imagePart->second.body.begin(), imagePart->second.body.end());
-    imageAndClassification.image = cv::imdecode(imageData, cv::IMREAD_COLOR);
+    // at the smallest resolution that still covers the feature size
+    const std::string& imageData = imagePart->second.body;
+    std::string errorMessage;
+    if (decodeUploadedImage((const uchar*)imageData.data(), imageData.size(), imageAndClassification.image, errorMessage) != 200) {
+        std::cerr << errorMessage << std::endl;
+        return imageAndClassification;
+    }
     // Test print
     // showMat(imageAndClassification.image);
 
@@ -388,8 +521,8 @@ bool isImageBlurry(cv::Mat image) {
 
 cv::Mat preprocessImages(cv::Mat image) {
     // Resize the image
-    int targetWidth = 128;
-    int targetHeight = 128;
+    int targetWidth = featureImageSize;
+    int targetHeight = featureImageSize;
     cv::Size targetSize(targetWidth, targetHeight);
     cv::resize(image, image, targetSize);
 